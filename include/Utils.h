@@ -122,10 +122,12 @@ void CheckError(cl_int error) {
 }
 
 void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
 	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
+	if (!file) {
+		cerr << "Cannot open " << file_name << endl;
+		throw cl::Error(CL_INVALID_VALUE, "AddSources");
+	}
+	sources.push_back(string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()))); // Sources holds its own copy
 }
 
 string ListPlatformsDevices() {
@@ -195,7 +197,8 @@ cl::Context GetContext(int platform_id, int device_id) {
 		}
 	}
 
-	return cl::Context();
+	cerr << "Platform " << platform_id << ", device " << device_id << " not found (see -l)" << endl;
+	throw cl::Error(CL_DEVICE_NOT_FOUND, "GetContext"); // a default context would only fail later
 }
 
 enum ProfilingResolution {
@@ -205,13 +208,28 @@ enum ProfilingResolution {
 	PROF_S = 1000000000
 };
 
+// The four device timestamps of a profiled command in ns
+struct ProfilingTimes {
+	cl_ulong queued, submit, start, end;
+};
+
+ProfilingTimes GetProfilingTimes(const cl::Event& evnt) {
+	ProfilingTimes times;
+	times.queued = evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+	times.submit = evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+	times.start = evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	times.end = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	return times;
+}
+
 string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution) {
 	stringstream sstream;
+	ProfilingTimes times = GetProfilingTimes(evnt);
 
-	sstream << "Queued " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
-	sstream << ", Submitted " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()) / resolution;
-	sstream << ", Executed " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / resolution;
-	sstream << ", Total " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
+	sstream << "Queued " << (times.submit - times.queued) / resolution;
+	sstream << ", Submitted " << (times.start - times.submit) / resolution;
+	sstream << ", Executed " << (times.end - times.start) / resolution;
+	sstream << ", Total " << (times.end - times.queued) / resolution;
 
 	switch (resolution) {
 	case PROF_NS: sstream << " [ns]"; break;
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <cstdio>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include "HistEqProfile.h"
+#include "Report.h"
+
+// Trace of device commands and host work in the Trace Event format read by chrome://tracing and Perfetto. Each command
+// queue gets a track under the device and each host thread one under the host, so gaps and overlap between transfers,
+// kernels and file I/O show on one timeline. Device timestamps are moved onto the host clock with clGetDeviceAndHostTimer
+// on OpenCL 2.1 devices, otherwise with an offset measured from marker commands.
+class ChromeTrace {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	// start is time 0 of the trace, no host work added may begin earlier
+	ChromeTrace(const cl::Context& context, const cl::Device& device, clock::time_point start = clock::now()) : origin(start) {
+		if (!device_and_host_timer(device))
+			calibrate(context, device);
+
+		std::cout << "Trace clock: " << clock_source << ", device time = host time + " << device_offset << " ns" << std::endl;
+
+		string device_name = device.getInfo<CL_DEVICE_NAME>();
+		metadata(1, 0, "process_name", "Device " + device_name);
+		metadata(2, 0, "process_name", "Host");
+		const char* queues[] = { "upload", "kernel", "download" };
+		for (int q = 0; q < 3; q++)
+			metadata(1, q + 1, "thread_name", string(queues[q]) + " queue");
+	}
+
+	// One slice per command on the track of its queue, labelled with the image it belongs to
+	void add_device(const std::vector<CommandProfile>& commands, const string& image = "") {
+		for (const CommandProfile& command : commands) {
+			int track = (command.queue == "upload") ? 1 : (command.queue == "download") ? 3 : 2;
+			std::stringstream args;
+			args << "{ \"image\": " << JsonString(image) << ", \"bytes\": " << command.bytes() << ", \"queued_ns\": " << command.queue_delay()
+				<< ", \"submitted_ns\": " << command.submit_delay() << " }";
+			slice(1, track, command.name, command.stage, host_ns(command.times.start), command.execution(), args.str());
+		}
+	}
+
+	// One slice on the calling thread's track for host work that started at start and took ns
+	void add_host(const string& name, clock::time_point start, unsigned long long ns) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = threads.find(std::this_thread::get_id());
+		if (found == threads.end()) {
+			found = threads.emplace(std::this_thread::get_id(), (int)threads.size() + 1).first;
+			metadata_locked(2, found->second, "thread_name", (found->second == 1) ? "main thread" : "thread " + std::to_string(found->second));
+		}
+		slice_locked(2, found->second, name, "host", (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin).count(), ns, "{}");
+	}
+
+	bool write(const string& file_name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		ofstream file(file_name, ios::trunc);
+
+		file << "{ \"displayTimeUnit\": \"ns\", \"otherData\": { \"clock\": " << JsonString(clock_source) << " }, \"traceEvents\": [";
+		for (size_t i = 0; i < events.size(); i++)
+			file << (i ? "," : "") << "\n  " << events[i];
+		file << "\n] }\n";
+
+		if (!file) {
+			std::cerr << "Cannot write trace " << file_name << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	const string& get_clock_source() const { return clock_source; }
+
+private:
+	clock::time_point origin; // time 0 of the trace
+	long long device_offset = 0; // device timestamp minus steady_clock time since its epoch, ns
+	string clock_source;
+	std::mutex mutex; // host slices may come from several threads
+	std::map<std::thread::id, int> threads; // host thread to track
+	std::vector<string> events;
+
+	// Device timestamp as ns since origin
+	long long host_ns(cl_ulong device_time) const {
+		return (long long)device_time - device_offset - (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(origin.time_since_epoch()).count();
+	}
+
+	// clGetDeviceAndHostTimer samples the device timer and the runtime's host timer at once. Which clock the host timer
+	// reads is up to the implementation, so it is placed on steady_clock by reading it with clGetHostTimer between two
+	// steady_clock reads, taking the tightest of a few brackets. Both are core OpenCL 2.1, so they are looked up at run
+	// time rather than linked, and only called for devices that report 2.1 or later.
+	bool device_and_host_timer(const cl::Device& device) {
+		typedef cl_int(CL_API_CALL* DeviceAndHostTimerFunction)(cl_device_id, cl_ulong*, cl_ulong*);
+		typedef cl_int(CL_API_CALL* HostTimerFunction)(cl_device_id, cl_ulong*);
+
+		int major = 0, minor = 0;
+		if ((sscanf(device.getInfo<CL_DEVICE_VERSION>().c_str(), "OpenCL %d.%d", &major, &minor) != 2) || (major * 10 + minor < 21))
+			return false;
+
+#ifdef _WIN32
+		HMODULE library = GetModuleHandleA("OpenCL.dll");
+		DeviceAndHostTimerFunction device_and_host_timer = library ? (DeviceAndHostTimerFunction)GetProcAddress(library, "clGetDeviceAndHostTimer") : NULL;
+		HostTimerFunction host_timer = library ? (HostTimerFunction)GetProcAddress(library, "clGetHostTimer") : NULL;
+#else
+		DeviceAndHostTimerFunction device_and_host_timer = (DeviceAndHostTimerFunction)dlsym(RTLD_DEFAULT, "clGetDeviceAndHostTimer");
+		HostTimerFunction host_timer = (HostTimerFunction)dlsym(RTLD_DEFAULT, "clGetHostTimer");
+#endif
+		if ((device_and_host_timer == NULL) || (host_timer == NULL))
+			return false;
+
+		// host timer minus steady_clock time since its epoch
+		long long host_offset = 0, best_bracket = -1;
+		for (int i = 0; i < 10; i++) {
+			cl_ulong host_time;
+			clock::time_point before = clock::now();
+			if (host_timer(device(), &host_time) != CL_SUCCESS)
+				return false; // optional in OpenCL 3.0
+			clock::time_point after = clock::now();
+
+			long long bracket = std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count();
+			if ((best_bracket >= 0) && (bracket >= best_bracket))
+				continue;
+
+			best_bracket = bracket;
+			long long middle = std::chrono::duration_cast<std::chrono::nanoseconds>(before.time_since_epoch()).count() + bracket / 2;
+			host_offset = (long long)host_time - middle;
+		}
+
+		cl_ulong device_time, host_time;
+		if (device_and_host_timer(device(), &device_time, &host_time) != CL_SUCCESS)
+			return false;
+
+		device_offset = (long long)device_time - ((long long)host_time - host_offset);
+		clock_source = "clGetDeviceAndHostTimer, host timer +/- " + std::to_string(best_bracket / 2) + " ns";
+		return true;
+	}
+
+	// Bracket marker commands between two host clock reads and take the one bracketed most tightly; its device END is
+	// assumed to fall halfway between them
+	void calibrate(const cl::Context& context, const cl::Device& device) {
+		cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+		long long best_bracket = -1;
+
+		for (int i = 0; i < 10; i++) {
+			cl::Event marker;
+			clock::time_point before = clock::now();
+			queue.enqueueMarkerWithWaitList(NULL, &marker);
+			marker.wait();
+			clock::time_point after = clock::now();
+
+			long long bracket = std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count();
+			if ((best_bracket >= 0) && (bracket >= best_bracket))
+				continue;
+
+			best_bracket = bracket;
+			long long middle = std::chrono::duration_cast<std::chrono::nanoseconds>(before.time_since_epoch()).count() + bracket / 2;
+			device_offset = (long long)marker.getProfilingInfo<CL_PROFILING_COMMAND_END>() - middle;
+		}
+
+		clock_source = "marker calibration, +/- " + std::to_string(best_bracket / 2) + " ns";
+	}
+
+	void slice(int pid, int tid, const string& name, const string& category, long long start_ns, unsigned long long ns, const string& args) {
+		std::lock_guard<std::mutex> lock(mutex);
+		slice_locked(pid, tid, name, category, start_ns, ns, args);
+	}
+
+	// Complete event, timestamps in us as the format requires
+	void slice_locked(int pid, int tid, const string& name, const string& category, long long start_ns, unsigned long long ns, const string& args) {
+		std::stringstream event;
+		event.precision(3);
+		event << std::fixed << "{ \"name\": " << JsonString(name) << ", \"cat\": " << JsonString(category) << ", \"ph\": \"X\", \"ts\": " << start_ns / 1e3
+			<< ", \"dur\": " << ns / 1e3 << ", \"pid\": " << pid << ", \"tid\": " << tid << ", \"args\": " << args << " }";
+		events.push_back(event.str());
+	}
+
+	void metadata(int pid, int tid, const string& kind, const string& name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		metadata_locked(pid, tid, kind, name);
+	}
+
+	void metadata_locked(int pid, int tid, const string& kind, const string& name) {
+		events.push_back("{ \"name\": " + JsonString(kind) + ", \"ph\": \"M\", \"pid\": " + std::to_string(pid) + ", \"tid\": " + std::to_string(tid)
+			+ ", \"args\": { \"name\": " + JsonString(name) + " } }");
+	}
+};
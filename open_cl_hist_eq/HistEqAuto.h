@@ -0,0 +1,169 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+
+#include "HistEqEngine.h"
+#include "HostHistEq.h"
+#include "ProgramCache.h"
+
+// Linear cost of equalising one image of n pixels on a backend, from the call to the finished output
+struct BackendCost {
+	double fixed_ns = 0; // launches, transfers set up, thread start
+	double per_pixel_ns = 0;
+
+	double predict(size_t n) const { return fixed_ns + per_pixel_ns * n; }
+};
+
+// Routes each image to HostHistEq or HistEqEngine, whichever a per-device cost model predicts is faster. Small images
+// are dominated by the fixed OpenCL launch and transfer cost and stay on the host, large ones go to the device.
+// The model is measured once per device, driver and set of options and kept in the cache directory next to the program
+// binaries; without a usable OpenCL device everything runs on the host.
+class HistEqAuto {
+public:
+	HistEqAuto(int platform_id, int device_id, const HistEqOptions& engine_options = HistEqOptions(), bool recalibrate = false)
+		: options(engine_options), host(engine_options, engine_options.host_threads) {
+		try {
+			engine.reset(new HistEqEngine(platform_id, device_id, options));
+		}
+		catch (const cl::Error& err) {
+			std::cout << "OpenCL unavailable (" << err.what() << ", " << getErrorString(err.err()) << "), using the host backend only" << std::endl;
+			return;
+		}
+
+		if (recalibrate || !load_model())
+			calibrate();
+	}
+
+	// Equalise one image on the backend predicted to be faster, logging the choice
+	template <typename T>
+	CImg<T> equalize(const CImg<T>& image_input) {
+		size_t pixels = image_input.size();
+		last_backend = "host";
+
+		if (engine && (pixels <= (size_t)INT_MAX)) { // the device histogram counts in int, the host's in 64 bits
+			double host_ns = host_cost.predict(pixels);
+			double opencl_ns = opencl_cost.predict(pixels);
+			if (opencl_ns < host_ns)
+				last_backend = "opencl";
+
+			std::cout << "Backend for " << image_input.width() << "x" << image_input.height() << "x" << image_input.spectrum() << ": host "
+				<< host_ns / 1e6 << " ms, opencl " << opencl_ns / 1e6 << " ms predicted, using " << last_backend << std::endl;
+		}
+
+		return (last_backend == "opencl") ? engine->equalize(image_input) : host.equalize(image_input);
+	}
+
+	// Image size in pixels above which the device is predicted to win. 0 when it always wins, being no slower per pixel
+	// and no slower to start; SIZE_MAX when it never does, being no faster per pixel.
+	size_t crossover() const {
+		if (!engine || (opencl_cost.per_pixel_ns >= host_cost.per_pixel_ns))
+			return SIZE_MAX;
+		double fixed_difference = opencl_cost.fixed_ns - host_cost.fixed_ns;
+		if (fixed_difference <= 0)
+			return 0;
+		return (size_t)(fixed_difference / (host_cost.per_pixel_ns - opencl_cost.per_pixel_ns));
+	}
+
+	const string& get_last_backend() const { return last_backend; } // backend of the last equalize call
+	HistEqEngine* get_engine() { return engine.get(); } // NULL without OpenCL
+	HostHistEq& get_host() { return host; }
+	const BackendCost& get_host_cost() const { return host_cost; }
+	const BackendCost& get_opencl_cost() const { return opencl_cost; }
+
+private:
+	HistEqOptions options;
+	std::unique_ptr<HistEqEngine> engine;
+	HostHistEq host;
+	BackendCost host_cost, opencl_cost;
+	string last_backend;
+
+	string crossover_text() const {
+		size_t pixels = crossover();
+		if (pixels == SIZE_MAX) return "none, the host is always faster";
+		if (pixels == 0) return "0 pixels, the device is always faster";
+		return std::to_string(pixels) + " pixels";
+	}
+
+	// Everything the costs depend on, so a model is never reused for a different device, driver or pipeline
+	string model_key() {
+		const cl::Device& device = engine->get_device();
+		const HistEqOptions& used = engine->get_options();
+		stringstream key;
+		key << device.getInfo<CL_DEVICE_NAME>() << "|" << device.getInfo<CL_DRIVER_VERSION>() << "|" << used.hist_mode << "|" << used.scan_mode
+			<< "|" << used.fuse_lut << "|" << used.zero_copy << "|" << used.bin_size << "|" << host.get_thread_count() << "|" << HostIsaName(host.get_isa());
+		return key.str();
+	}
+
+	string model_file() {
+		return options.cache_dir + "/cost_" + HashToHex(HashString(model_key())) + ".txt";
+	}
+
+	bool load_model() {
+		if (options.cache_dir.empty())
+			return false;
+
+		ifstream file(model_file());
+		string key;
+		if (!getline(file, key) || (key != model_key()))
+			return false;
+		if (!(file >> host_cost.fixed_ns >> host_cost.per_pixel_ns >> opencl_cost.fixed_ns >> opencl_cost.per_pixel_ns))
+			return false;
+
+		std::cout << "Loaded backend cost model from " << model_file() << ", crossover " << crossover_text() << std::endl;
+		return true;
+	}
+
+	// Best wall-clock time of a few runs of equalize on a random image of the given size, after one warm-up run
+	template <typename Backend>
+	static double time_equalize(Backend& backend, const CImg<unsigned char>& image) {
+		typedef std::chrono::steady_clock clock;
+		double best = 0;
+
+		for (int r = -1; r < 5; r++) {
+			clock::time_point start = clock::now();
+			backend.equalize(image);
+			double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+			if ((r == 0) || ((r > 0) && (ns < best)))
+				best = ns;
+		}
+
+		return best;
+	}
+
+	// Fit fixed and per pixel costs through the times of a small and a large image on each backend
+	void calibrate() {
+		CImg<unsigned char> small_image(128, 128), large_image(2048, 1024);
+		for (unsigned char& pixel : small_image) pixel = (unsigned char)(rand() % 256);
+		for (unsigned char& pixel : large_image) pixel = (unsigned char)(rand() % 256);
+
+		double small_pixels = (double)small_image.size(), large_pixels = (double)large_image.size();
+
+		for (int b = 0; b < 2; b++) {
+			double small_ns = (b == 0) ? time_equalize(host, small_image) : time_equalize(*engine, small_image);
+			double large_ns = (b == 0) ? time_equalize(host, large_image) : time_equalize(*engine, large_image);
+
+			BackendCost& cost = (b == 0) ? host_cost : opencl_cost;
+			cost.per_pixel_ns = (large_ns - small_ns) / (large_pixels - small_pixels);
+			if (cost.per_pixel_ns < 0) cost.per_pixel_ns = 0; // timing noise on a tiny device workload
+			cost.fixed_ns = small_ns - cost.per_pixel_ns * small_pixels;
+			if (cost.fixed_ns < 0) cost.fixed_ns = 0;
+		}
+
+		std::cout << "Calibrated backend cost model: host " << host_cost.fixed_ns / 1e3 << " us + " << host_cost.per_pixel_ns << " ns/pixel, opencl "
+			<< opencl_cost.fixed_ns / 1e3 << " us + " << opencl_cost.per_pixel_ns << " ns/pixel, crossover " << crossover_text() << std::endl;
+
+		if (options.cache_dir.empty())
+			return;
+
+		MakeDirectory(options.cache_dir);
+		ofstream file(model_file(), ios::trunc);
+		file << model_key() << '\n' << host_cost.fixed_ns << ' ' << host_cost.per_pixel_ns << ' ' << opencl_cost.fixed_ns << ' ' << opencl_cost.per_pixel_ns << '\n';
+	}
+};
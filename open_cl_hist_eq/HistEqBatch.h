@@ -0,0 +1,264 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+
+#include "HistEqEngine.h"
+#include "HostHistEq.h"
+#include "HistEqProfile.h"
+#include "ChromeTrace.h"
+#include "PnmHeader.h"
+
+namespace fs = std::filesystem;
+
+// Image files CImg reads without an external decoder
+bool IsBatchImage(const fs::path& path) {
+	string extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return (extension == ".pgm") || (extension == ".ppm") || (extension == ".pnm") || (extension == ".bmp");
+}
+
+// Input images for a batch - every image in a directory (sorted by name), or one path per line of a list file
+std::vector<string> BatchInputs(const string& input) {
+	std::vector<string> inputs;
+
+	if (fs::is_directory(input)) {
+		for (const fs::directory_entry& entry : fs::directory_iterator(input)) {
+			if (entry.is_regular_file() && IsBatchImage(entry.path()))
+				inputs.push_back(entry.path().string());
+		}
+		std::sort(inputs.begin(), inputs.end());
+	}
+	else {
+		ifstream list(input);
+		string line;
+		while (getline(list, line)) {
+			if (!line.empty() && (line.back() == '\r'))
+				line.pop_back(); // list written on Windows
+			if (!line.empty())
+				inputs.push_back(line);
+		}
+	}
+
+	return inputs;
+}
+
+// Device time spent on the commands of one image in ns, summed over every command rather than measured end to end
+unsigned long long BusyTime(const HistEqEvents& events) {
+	unsigned long long busy = 0;
+	for (const cl::Event* event : { &events.write, &events.hist_kernel, &events.hist_read, &events.cumulative_read, &events.norm_kernel,
+		&events.norm_read, &events.lut_kernel, &events.lut_read, &events.enhance_kernel, &events.enhance_read })
+		busy += HistEqEngine::event_time(*event);
+	for (const cl::Event& event : events.cumulative_kernels)
+		busy += HistEqEngine::event_time(event);
+	for (const StripEvents& strip : events.strips) {
+		for (const cl::Event* event : { &strip.write, &strip.hist_kernel, &strip.second_write, &strip.enhance_kernel, &strip.enhance_read })
+			busy += HistEqEngine::event_time(*event);
+	}
+	return busy;
+}
+
+// Equalise every input with the same engine - one context, program and buffer set for the whole batch - and write each
+// result to output_dir under its input file name. Up to depth images are in flight at once, each on its own pipeline slot,
+// so the upload of one image, the kernels of the next and the download of a third overlap, while the host decodes and
+// encodes files in between. depth 1 runs the images strictly one after another.
+// Prints per-image and overall throughput, and how much the device commands overlapped according to their profiling
+// timestamps. Images that fail to load or save are reported and skipped. Returns the number of images written.
+// With a trace, every device command and the host's decoding, enqueueing, waiting and saving are added to it.
+int RunBatch(HistEqEngine& engine, const std::vector<string>& inputs, const string& output_dir, int depth = 3, ChromeTrace* trace = NULL) {
+	typedef std::chrono::steady_clock clock;
+
+	struct Slot {
+		string input;
+		CImg<unsigned char> image_input, image_output; // host memory the device reads and writes, kept until the download ends
+		HistEqEvents events;
+		bool busy = false;
+	};
+
+	fs::create_directories(output_dir);
+
+	if (depth < 1) depth = 1;
+	std::vector<Slot> slots(depth);
+
+	int image_count = 0;
+	unsigned long long pixel_count = 0;
+	unsigned long long busy_time = 0; // sum of every device command, ns
+	cl_ulong first_start = 0, last_end = 0; // device timestamps bounding the whole batch
+	clock::time_point batch_start = clock::now();
+
+	// wait for the image on a slot, write it out and free the slot
+	auto finish = [&](Slot& slot) {
+		slot.busy = false;
+
+		try {
+			clock::time_point wait_start = clock::now();
+			slot.events.last_command().wait();
+			clock::time_point save_start = clock::now();
+
+			string output = (fs::path(output_dir) / fs::path(slot.input).filename()).string();
+			slot.image_output.save(output.c_str());
+
+			if (trace != NULL) {
+				HistEqProfile profile;
+				profile.add_commands(slot.events, engine.get_options(), slot.image_input.size());
+				trace->add_device(profile.get_commands(), slot.input);
+				trace->add_host("wait " + slot.input, wait_start, std::chrono::duration_cast<std::chrono::nanoseconds>(save_start - wait_start).count());
+				trace->add_host("save " + output, save_start, std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - save_start).count());
+			}
+
+			cl_ulong start = slot.events.first_command().getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong end = slot.events.last_command().getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			if ((image_count == 0) || (start < first_start)) first_start = start;
+			if (end > last_end) last_end = end;
+
+			unsigned long long pixels = (unsigned long long)slot.image_input.width() * slot.image_input.height();
+			image_count++;
+			pixel_count += pixels;
+			busy_time += BusyTime(slot.events);
+
+			std::cout << slot.input << " -> " << output << ": " << slot.image_input.width() << "x" << slot.image_input.height()
+				<< ", " << (end - start) / 1e6 << " ms on the device, " << pixels / ((end - start) / 1e9) / 1e6 << " MPix/s" << std::endl;
+		}
+		catch (CImgException& err) {
+			std::cerr << slot.input << ": " << err.what() << std::endl;
+		}
+	};
+
+	for (size_t i = 0; i < inputs.size(); i++) {
+		int slot_id = (int)(i % depth);
+		Slot& slot = slots[slot_id];
+
+		if (slot.busy)
+			finish(slot); // oldest image in flight, the other slots keep the device busy meanwhile
+
+		clock::time_point decode_start = clock::now();
+		try {
+			slot.input = inputs[i];
+			slot.image_input.assign(); // drop the view of the last image before reusing the slot
+
+			// with zero-copy buffers the file is decoded straight into memory the device reads in place
+			PnmHeader header;
+			unsigned char* input_memory = NULL;
+			if (ReadPnmHeader(inputs[i], header) && !engine.streams(header.raster_size()))
+				input_memory = engine.host_input(header.raster_size(), slot_id);
+
+			if (input_memory != NULL) {
+				slot.image_input.assign(input_memory, header.width, header.height, 1, header.channels, true); // shared view, no copy
+				slot.image_input.load_pnm(inputs[i].c_str());
+			}
+			else {
+				slot.image_input.assign(inputs[i].c_str());
+			}
+		}
+		catch (CImgException& err) {
+			std::cerr << inputs[i] << ": " << err.what() << std::endl;
+			continue;
+		}
+
+		clock::time_point enqueue_start = clock::now();
+		if (trace != NULL)
+			trace->add_host("decode " + inputs[i], decode_start, std::chrono::duration_cast<std::chrono::nanoseconds>(enqueue_start - decode_start).count());
+
+		if (slot.image_input.size() > (size_t)INT_MAX) { // the device histogram counts in int
+			std::cerr << inputs[i] << ": more than INT_MAX pixels, equalise it on its own with -out_of_core" << std::endl;
+			continue;
+		}
+
+		if (engine.streams(slot.image_input.size())) { // too large for a slot's buffers, equalised in strips before moving on
+			slot.image_output = engine.equalize(slot.image_input);
+			slot.events = engine.get_events();
+			slot.busy = true;
+			if (trace != NULL)
+				trace->add_host("equalize " + inputs[i], enqueue_start, std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - enqueue_start).count());
+			continue;
+		}
+
+		unsigned char* output_memory = engine.host_output(slot.image_input.size(), slot_id);
+		slot.image_output.assign();
+		if (output_memory != NULL)
+			slot.image_output.assign(output_memory, slot.image_input.width(), slot.image_input.height(), slot.image_input.depth(), slot.image_input.spectrum(), true);
+		else
+			slot.image_output.assign(slot.image_input.width(), slot.image_input.height(), slot.image_input.depth(), slot.image_input.spectrum());
+		slot.events = engine.enqueue_equalize(slot.image_input.data(), slot.image_output.data(), slot.image_input.size(), slot_id);
+		slot.busy = true;
+
+		if (trace != NULL)
+			trace->add_host("enqueue " + inputs[i], enqueue_start, std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - enqueue_start).count());
+	}
+
+	for (size_t i = inputs.size(); i < inputs.size() + depth; i++) { // drain in submission order
+		Slot& slot = slots[i % depth];
+		if (slot.busy)
+			finish(slot);
+	}
+
+	double batch_seconds = std::chrono::duration<double>(clock::now() - batch_start).count(); // includes decoding and encoding
+
+	std::cout << std::endl;
+	std::cout << "Batch: " << image_count << " of " << inputs.size() << " images, " << pixel_count / 1e6 << " MPix, " << depth << " in flight" << std::endl;
+	if (image_count > 0) {
+		double device_seconds = (last_end - first_start) / 1e9;
+		std::cout << "- device: " << image_count / device_seconds << " images/s, " << pixel_count / device_seconds / 1e6 << " MPix/s" << std::endl;
+		std::cout << "- with file I/O: " << image_count / batch_seconds << " images/s, " << pixel_count / batch_seconds / 1e6 << " MPix/s" << std::endl;
+		// busy time above the span is work that ran at the same time as other work, 1.00x means nothing overlapped
+		std::cout << "- overlap: " << busy_time / 1e6 << " ms of commands in " << (last_end - first_start) / 1e6 << " ms, "
+			<< (double)busy_time / (last_end - first_start) << "x" << std::endl;
+	}
+
+	return image_count;
+}
+
+// RunBatch for the host and automatic backends - images are equalised one at a time through backend.equalize, the host
+// backend using every worker thread for each
+template <typename Backend>
+int RunSerialBatch(Backend& backend, const std::vector<string>& inputs, const string& output_dir) {
+	typedef std::chrono::steady_clock clock;
+
+	fs::create_directories(output_dir);
+
+	int image_count = 0;
+	unsigned long long pixel_count = 0;
+	double equalize_seconds = 0; // time inside equalize only
+	clock::time_point batch_start = clock::now();
+
+	for (const string& input : inputs) {
+		try {
+			CImg<unsigned char> image_input(input.c_str());
+
+			clock::time_point start = clock::now();
+			CImg<unsigned char> image_output = backend.equalize(image_input);
+			double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+			string output = (fs::path(output_dir) / fs::path(input).filename()).string();
+			image_output.save(output.c_str());
+
+			unsigned long long pixels = (unsigned long long)image_input.width() * image_input.height();
+			image_count++;
+			pixel_count += pixels;
+			equalize_seconds += seconds;
+
+			std::cout << input << " -> " << output << ": " << image_input.width() << "x" << image_input.height()
+				<< ", " << seconds * 1000 << " ms, " << pixels / seconds / 1e6 << " MPix/s" << std::endl;
+		}
+		catch (CImgException& err) {
+			std::cerr << input << ": " << err.what() << std::endl;
+		}
+	}
+
+	double batch_seconds = std::chrono::duration<double>(clock::now() - batch_start).count(); // includes decoding and encoding
+
+	std::cout << std::endl;
+	std::cout << "Batch: " << image_count << " of " << inputs.size() << " images, " << pixel_count / 1e6 << " MPix" << std::endl;
+	if (image_count > 0) {
+		std::cout << "- equalize: " << image_count / equalize_seconds << " images/s, " << pixel_count / equalize_seconds / 1e6 << " MPix/s" << std::endl;
+		std::cout << "- with file I/O: " << image_count / batch_seconds << " images/s, " << pixel_count / batch_seconds / 1e6 << " MPix/s" << std::endl;
+	}
+
+	return image_count;
+}
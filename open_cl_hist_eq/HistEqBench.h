@@ -0,0 +1,154 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+#include "HistEqEngine.h"
+#include "HostHistEq.h"
+#include "Report.h"
+
+// Synthetic 8-bit greyscale image of about megapixels million pixels, identical for the same arguments on every run.
+// "uniform" uses every value equally, "dark" skews most pixels towards black like an under-exposed photo, and "single"
+// gives every pixel the same value, the worst case for the histogram atomics. Returns an empty image for anything else.
+CImg<unsigned char> SyntheticImage(double megapixels, const string& distribution, unsigned int seed = 1) {
+	size_t pixels = (size_t)(megapixels * 1e6);
+	int width = std::max(16, ((int)std::sqrt((double)pixels) / 16) * 16); // square, rows of whole uchar16 loads
+	int height = (int)std::max<size_t>(1, (pixels + width - 1) / width);
+
+	CImg<unsigned char> image;
+	std::mt19937 random(seed);
+
+	if (distribution == "uniform") {
+		std::uniform_int_distribution<int> value(0, 255);
+		image.assign(width, height);
+		for (unsigned char& pixel : image)
+			pixel = (unsigned char)value(random);
+	}
+	else if (distribution == "dark") {
+		std::uniform_real_distribution<double> unit(0, 1);
+		image.assign(width, height);
+		for (unsigned char& pixel : image)
+			pixel = (unsigned char)(255 * std::pow(unit(random), 4)); // median value around 15
+	}
+	else if (distribution == "single") {
+		image.assign(width, height, 1, 1, 128);
+	}
+
+	return image;
+}
+
+// Times of one stage over the measured repetitions of one image, in ns
+struct BenchSeries {
+	string backend, distribution, stage;
+	int width, height;
+	std::vector<double> samples;
+};
+
+// Run every backend given over synthetic images of each size and distribution - warmup untimed runs, then repeats timed
+// ones - and report the median, 95th and 99th percentile of every kernel, transfer and the whole equalize call, with the
+// throughput at the median. engine may be NULL to benchmark the host only. Results go to <output>.json and <output>.csv.
+void RunBenchmark(HistEqEngine* engine, HostHistEq& host, const std::vector<double>& sizes, const std::vector<string>& distributions,
+	int warmup, int repeats, const string& output) {
+	typedef std::chrono::steady_clock clock;
+	std::vector<BenchSeries> results;
+
+	for (double size : sizes) {
+		for (const string& distribution : distributions) {
+			CImg<unsigned char> image = SyntheticImage(size, distribution);
+			if (image.is_empty()) {
+				std::cerr << "Unknown distribution " << distribution << " (uniform, dark or single)" << std::endl;
+				continue;
+			}
+
+			for (const string backend : { "opencl", "host" }) {
+				if ((backend == "opencl") && (engine == NULL))
+					continue;
+
+				std::vector<string> stages = (backend == "opencl") ? std::vector<string>{ "upload", "hist", "lut", "back_proj", "download", "end_to_end" }
+					: std::vector<string>{ "hist", "lut", "back_proj", "end_to_end" };
+				std::vector<BenchSeries> series;
+				for (const string& stage : stages)
+					series.push_back({ backend, distribution, stage, image.width(), image.height(), {} });
+
+				try {
+					for (int r = 0; r < warmup + repeats; r++) {
+						clock::time_point start = clock::now();
+						if (backend == "opencl")
+							engine->equalize(image);
+						else
+							host.equalize(image);
+						double wall = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+						if (r < warmup)
+							continue;
+
+						std::vector<double> times; // same order as stages
+						if (backend == "opencl") {
+							const HistEqEvents& events = engine->get_events();
+							double lut = (double)(HistEqEngine::event_time(events.norm_kernel) + HistEqEngine::event_time(events.lut_kernel));
+							for (const cl::Event& event : events.cumulative_kernels)
+								lut += HistEqEngine::event_time(event); // scan, normalise and look up table, fused or not
+							times = { (double)HistEqEngine::event_time(events.write), (double)HistEqEngine::event_time(events.hist_kernel), lut,
+								(double)HistEqEngine::event_time(events.enhance_kernel), (double)HistEqEngine::event_time(events.enhance_read), wall };
+							for (const StripEvents& strip : events.strips) { // an image streamed in strips uploads each strip twice
+								times[0] += (double)(HistEqEngine::event_time(strip.write) + HistEqEngine::event_time(strip.second_write));
+								times[1] += (double)HistEqEngine::event_time(strip.hist_kernel);
+								times[3] += (double)HistEqEngine::event_time(strip.enhance_kernel);
+								times[4] += (double)HistEqEngine::event_time(strip.enhance_read);
+							}
+						}
+						else {
+							const HostHistEqTimes& host_times = host.get_times();
+							times = { (double)host_times.hist, (double)host_times.lut, (double)host_times.back_proj, wall };
+						}
+
+						for (size_t s = 0; s < series.size(); s++)
+							series[s].samples.push_back(times[s]);
+					}
+				}
+				catch (const cl::Error& err) { // e.g. larger than the device's maximum allocation
+					std::cerr << backend << " " << image.width() << "x" << image.height() << " skipped: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+					continue;
+				}
+
+				for (const BenchSeries& s : series) {
+					double median = Percentile(s.samples, 50);
+					std::cout << backend << " " << distribution << " " << image.size() / 1e6 << " MPix " << s.stage << ": median " << median / 1e6
+						<< " ms, p95 " << Percentile(s.samples, 95) / 1e6 << " ms, p99 " << Percentile(s.samples, 99) / 1e6 << " ms, "
+						<< ((median > 0) ? image.size() / median * 1e3 : 0) << " MPix/s" << std::endl;
+					results.push_back(s);
+				}
+			}
+		}
+	}
+
+	ofstream json(output + ".json", ios::trunc);
+	ofstream csv(output + ".csv", ios::trunc);
+
+	json << "{\n  \"device\": " << JsonString(engine ? engine->get_device().getInfo<CL_DEVICE_NAME>() : string("none"))
+		<< ",\n  \"host_threads\": " << host.get_thread_count() << ",\n  \"host_isa\": " << JsonString(HostIsaName(host.get_isa()))
+		<< ",\n  \"warmup\": " << warmup << ",\n  \"repeats\": " << repeats << ",\n  \"results\": [";
+	csv << "backend,distribution,width,height,megapixels,stage,median_ns,p95_ns,p99_ns,mpix_per_s\n";
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchSeries& s = results[i];
+		double pixels = (double)s.width * s.height;
+		double median = Percentile(s.samples, 50), p95 = Percentile(s.samples, 95), p99 = Percentile(s.samples, 99);
+		double throughput = (median > 0) ? pixels / median * 1e3 : 0; // MPix/s, a stage may be too short to measure
+
+		json << (i ? "," : "") << "\n    { \"backend\": " << JsonString(s.backend) << ", \"distribution\": " << JsonString(s.distribution)
+			<< ", \"width\": " << s.width << ", \"height\": " << s.height << ", \"stage\": " << JsonString(s.stage) << ", \"median_ns\": " << median
+			<< ", \"p95_ns\": " << p95 << ", \"p99_ns\": " << p99 << ", \"mpix_per_s\": " << throughput << " }";
+		csv << s.backend << "," << s.distribution << "," << s.width << "," << s.height << "," << pixels / 1e6 << "," << s.stage << ","
+			<< median << "," << p95 << "," << p99 << "," << throughput << "\n";
+	}
+	json << "\n  ]\n}\n";
+
+	std::cout << "Results written to " << output << ".json and " << output << ".csv" << std::endl;
+}
@@ -0,0 +1,1038 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <numeric>
+#include <cmath>
+#include <type_traits>
+#include <memory>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+
+#include "Utils.h"
+#include "CImg.h"
+#include "ProgramCache.h"
+#include "KernelTuning.h"
+
+#if __has_include("EmbeddedKernels.h")
+#include "EmbeddedKernels.h" // generated by embed_kernels.ps1 before each build
+#define HAS_EMBEDDED_KERNELS
+#endif
+
+using namespace cimg_library;
+
+// Kernel variants and sizes used by HistEqEngine, set once per engine
+struct HistEqOptions {
+	string backend = "opencl"; // opencl, host for HostHistEq, or auto for HistEqAuto
+	unsigned int host_threads = 0; // worker threads for the host backend, 0 for one per hardware thread
+	string host_isa = "auto"; // SIMD for the host backend: auto (widest supported), avx512, avx2 or scalar
+	string hist_mode = "local"; // histogram kernel: global, local or vector
+	int pixels_per_item = 64; // strip length for the vector histogram, multiple of 16
+	string scan_mode = "hs"; // cumulative histogram scan: hs (Hillis-Steele), bl (Blelloch) or lb (look-back)
+	bool fuse_lut = true; // single kernel from histogram to look up table
+	bool debug = false; // read back and print every intermediate stage
+	int bin_size = 256; // number of histogram bins
+	int max_intensity = 256; // number of possible pixel values
+	bool specialise = true; // build the kernels for this bin_size and max_intensity rather than reading them as arguments
+	string zero_copy = "auto"; // image buffers over host memory: on, off, or auto (on when the device shares host memory)
+	string kernel_file = ""; // load the kernels from this file instead of the copy built into the executable
+	string cache_dir = "kernel_cache"; // directory of built program binaries, empty to always build from source
+	string tuning_file = "tuning.txt"; // launch sizes found by autotune, loaded at startup, empty to use the defaults
+	size_t strip_size = 0; // stream images of more pixels than this through strips of at most this size, 0 for the device's largest buffer, at most INT_MAX
+};
+
+// Profiling events of one strip of a streamed image
+struct StripEvents {
+	size_t pixels;
+	cl::Event write, hist_kernel; // first pass
+	cl::Event second_write, enhance_kernel, enhance_read; // second pass
+};
+
+// Profiling events of the commands enqueued by the last call to equalize, empty for stages that did not run
+struct HistEqEvents {
+	cl::Event write, hist_kernel, hist_read;
+	std::vector<cl::Event> cumulative_kernels; // one event per scan level and adjustment
+	cl::Event cumulative_read, norm_kernel, norm_read, lut_kernel, lut_read, enhance_kernel, enhance_read;
+	std::vector<StripEvents> strips; // streamed images only, which have no whole-image write, hist_kernel, enhance_kernel or enhance_read
+
+	// first and last command of the image on the device
+	const cl::Event& first_command() const { return strips.empty() ? write : strips.front().write; }
+	const cl::Event& last_command() const { return strips.empty() ? enhance_read : strips.back().enhance_read; }
+};
+
+// Best bandwidths measured by HistEqEngine::measure_bandwidth in GB/s, zero when not measured
+struct BandwidthPeaks {
+	double copy = 0; // device memory to device memory by a kernel, bytes read plus written
+	double upload = 0, download = 0; // between host memory and the device
+};
+
+// Histogram equalisation on one OpenCL device. The context, queue, built program and kernels are created once,
+// and buffers are kept between calls, one per role grown to the largest image so far, so one engine can process any
+// number of images of any mix of sizes.
+class HistEqEngine {
+public:
+	HistEqEngine(int platform_id, int device_id, const HistEqOptions& engine_options = HistEqOptions()) : options(engine_options) {
+		context = GetContext(platform_id, device_id); // select computing devices to be used with kernels
+		device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		queue = cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE); // create a queue to which we will push commands for the device
+		upload_queue = cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE); // image transfers have their own queues so they can overlap kernels
+		download_queue = cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE);
+
+		source = kernel_source("my_kernels.cl", options.kernel_file); // device code, hashed into the program cache key
+
+		size_t histogram_size = options.bin_size * sizeof(int);
+		size_t local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		size_t max_group_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
+		// each bin_size/max_intensity pair gets its own program, and its own binary in the cache
+		// correctly rounded division makes the look up table match HostHistEq bit for bit, where the device supports it
+		string base_options = (device.getInfo<CL_DEVICE_SINGLE_FP_CONFIG>() & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT) ? "-cl-fp32-correctly-rounded-divide-sqrt " : "";
+		string build_options = base_options;
+		hist_group_size = 0;
+		if (options.specialise) {
+			build_options += "-D BIN_SIZE=" + std::to_string(options.bin_size) + " -D MAX_INTENSITY=" + std::to_string(options.max_intensity);
+
+			if (((size_t)options.bin_size <= max_group_size) && (2 * histogram_size <= local_mem)) // hist_lut runs one work-item per bin
+				build_options += " -D LUT_GROUP_SIZE=" + std::to_string(options.bin_size);
+
+			hist_build_options = build_options; // programs for other histogram work-group sizes, see hist_kernel
+			if (histogram_size <= local_mem) { // static sub-histogram, only when it fits
+				hist_group_size = (max_group_size < 256) ? max_group_size : 256;
+				build_options += " -D HIST_GROUP_SIZE=" + std::to_string(hist_group_size);
+			}
+		}
+
+		// build and debug the kernel code, or load the binary built by an earlier run
+		bool from_cache;
+		try {
+			program = BuildProgramCached(context, device, source, build_options, options.cache_dir, &from_cache);
+		}
+		catch (const cl::Error&) {
+			if (build_options == base_options)
+				throw;
+
+			std::cout << "Specialised build failed, using generic kernels" << std::endl;
+			options.specialise = false;
+			hist_group_size = 0;
+			build_options = base_options;
+			program = BuildProgramCached(context, device, source, build_options, options.cache_dir, &from_cache);
+		}
+		if (from_cache)
+			std::cout << "Loaded program binary from " << options.cache_dir << std::endl;
+
+		for (const char* name : { "hist", "hist_local", "hist_vector", "hist_cumulative", "hist_cumulative_bl", "hist_cumulative_lb",
+			"block_sum", "scan_add_adjust", "normalise_array", "lut", "hist_lut", "back_proj", "copy_probe" })
+			kernels[name] = cl::Kernel(program, name);
+
+		if ((options.hist_mode != "global") && (histogram_size > local_mem)) {
+			std::cout << "Histogram does not fit in local memory, using global atomics" << std::endl;
+			options.hist_mode = "global";
+		}
+
+		options.pixels_per_item = ((options.pixels_per_item + 15) / 16) * 16; // whole uchar16 loads only
+		if (options.pixels_per_item < 16) options.pixels_per_item = 16;
+
+		scan_block_size = scan_block_limit(options.scan_mode); // largest block a single work-group can scan
+
+		if (options.fuse_lut && (options.scan_mode != "hs")) { // the fused kernel has its own Hillis-Steele scan, so any other scan needs the separate kernels
+			std::cout << "Scan " << options.scan_mode << " is not fused, using separate lut kernels" << std::endl;
+			options.fuse_lut = false;
+		}
+
+		if (options.fuse_lut && ((size_t)options.bin_size > scan_block_limit("hs"))) { // the fused kernel uses the Hillis-Steele work-group scan
+			std::cout << "Bin size exceeds one work-group (" << scan_block_limit("hs") << "), using separate lut kernels" << std::endl;
+			options.fuse_lut = false;
+		}
+
+		std::vector<int> bin_map = make_bin_map(options.bin_size, options.max_intensity); // built once per bin_size/max_intensity pair
+		buffer_bin_map = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bin_map.size() * sizeof(int), &bin_map[0]); // read by hist and back_proj
+
+		if (options.zero_copy == "auto")
+			options.zero_copy = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() ? "on" : "off"; // CPUs and integrated GPUs
+		zero_copy = (options.zero_copy == "on");
+
+		if (options.strip_size == 0)
+			options.strip_size = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(); // larger images cannot have a buffer of their own
+		options.strip_size = std::min(options.strip_size, (size_t)INT_MAX); // the histogram kernels count pixels in an int, larger images stream
+
+		if (!options.tuning_file.empty()) {
+			tunings = LoadTunings(options.tuning_file, tuning_key());
+			if (!tunings.empty())
+				std::cout << "Loaded tuned launch sizes for " << tunings.size() << " image size classes from " << options.tuning_file << std::endl;
+		}
+	}
+
+	// Equalise one image. Kernels read 8-bit pixels, so T must currently be unsigned char.
+	template <typename T>
+	CImg<T> equalize(const CImg<T>& image_input) {
+		static_assert(std::is_same<T, unsigned char>::value, "the OpenCL kernels process 8-bit pixels");
+
+		CImg<T> image_output(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum()); // space for the enhanced image
+
+		if (streams(image_input.size())) {
+			events = equalize_streamed(image_input.data(), image_output.data(), image_input.size(), image_input.width());
+			return image_output;
+		}
+
+		events = enqueue_equalize(image_input.data(), image_output.data(), image_input.size(), 0);
+		events.enhance_read.wait(); // the only wait outside debug mode
+
+		return image_output;
+	}
+
+	// Enqueue every command for one image of image_size pixels without waiting for any of it. The upload, the kernels and the
+	// download go to three queues, so the transfers of one image can run under the kernels of another. Each pipeline slot has
+	// its own input and output buffers and waits for the last image on the same slot to release them. input and output must
+	// stay alive until the returned enhance_read event completes.
+	HistEqEvents enqueue_equalize(const unsigned char* input, unsigned char* output, size_t image_size, int slot) {
+		int bin_size = options.bin_size;
+		size_t histogram_size = bin_size * sizeof(int); // get byte length of histogram space
+
+		if ((size_t)slot >= slot_events.size())
+			slot_events.resize(slot + 1);
+		const HistEqEvents previous = slot_events[slot]; // last image on this slot
+		HistEqEvents image_events;
+		HistEqTuning tuning = launch_tuning(image_size); // tuned sizes for this image's size class, zeros for the defaults
+
+		/////////// Calculate histogram ////////////////////////////////////////////////////////////////////////////////////////////
+
+		HostBuffer* host_in = find_host_buffer("image_input_" + std::to_string(slot), image_size, input); // input decoded into host_input memory
+		if ((host_in != NULL) && !host_in->mapped)
+			host_in = NULL; // memory not handed out by host_input for this image, copy it like any other
+		cl::Buffer& buffer_image_input = host_in ? host_in->buffer : buffer("image_input_" + std::to_string(slot), image_size, CL_MEM_READ_ONLY); // prepare input buffer for the kernel
+		cl::Buffer& buffer_histogram = buffer("histogram", histogram_size, CL_MEM_READ_WRITE); // prepare output buffer for the kernel
+
+		// every stage waits on the events of the stage before it, so nothing has to come back to the host until the final image
+		std::vector<cl::Event> dependencies(2);
+		if (host_in != NULL) {
+			upload_queue.enqueueUnmapMemObject(host_in->buffer, host_in->memory.get(), NULL, &dependencies[0]); // zero-copy, hands the memory back to the device
+			host_in->mapped = false;
+		}
+		else {
+			std::vector<cl::Event> input_free; // the slot's input is free once the last image on the slot has been projected from it
+			if (previous.enhance_kernel() != NULL)
+				input_free.push_back(previous.enhance_kernel);
+			upload_queue.enqueueWriteBuffer(buffer_image_input, CL_FALSE, 0, image_size, input, &input_free, &dependencies[0]); // non-blocking write on its own queue
+		}
+		upload_queue.flush(); // submit now, a blocking debug read on the kernel queue would otherwise wait on it forever
+		queue.enqueueFillBuffer(buffer_histogram, 0, 0, histogram_size, NULL, &dependencies[1]); // both histogram kernels accumulate, so start from zero
+		image_events.write = dependencies[0];
+
+		enqueue_hist(buffer_image_input, buffer_histogram, image_size, tuning, &dependencies, &image_events.hist_kernel);
+
+		dependencies = { image_events.hist_kernel };
+
+		if (options.debug) {
+			std::vector<int> histogram(bin_size);
+			queue.enqueueReadBuffer(buffer_histogram, CL_TRUE, 0, histogram_size, &histogram[0], &dependencies, &image_events.hist_read); // copy results from device to host (with timing event)
+
+			std::cout << "Raw histogram = " << histogram << std::endl << std::endl; // display calculated histogram for debug purposes
+		}
+
+		/////////// Create cumulative histogram, normalise and create look up table //////////////////////////////////////////////////
+
+		cl::Buffer& buffer_lut = buffer("lut", histogram_size, CL_MEM_READ_WRITE); // create buffer for lut output
+
+		enqueue_lut(buffer_histogram, buffer_lut, dependencies, image_events);
+
+		/////////// Create enhanced image from LUT ///////////////////////////////////////////////////////////////////////////////////////
+
+		HostBuffer* host_out = find_host_buffer("output_" + std::to_string(slot), image_size, output); // output is host_output memory
+		cl::Buffer& buffer_output = host_out ? host_out->buffer : buffer("output_" + std::to_string(slot), image_size, CL_MEM_READ_WRITE); // buffer for enhanced image output
+
+		if (previous.enhance_read() != NULL)
+			dependencies.push_back(previous.enhance_read); // the slot's output must have been downloaded before it is overwritten
+
+		if ((host_out != NULL) && host_out->mapped) { // the host is done with the last image on this slot, give the memory back
+			dependencies.push_back(cl::Event());
+			download_queue.enqueueUnmapMemObject(host_out->buffer, host_out->memory.get(), NULL, &dependencies.back());
+			host_out->mapped = false;
+		}
+
+		enqueue_back_proj(buffer_image_input, buffer_output, buffer_lut, image_size, tuning, &dependencies, &image_events.enhance_kernel);
+
+		dependencies = { image_events.enhance_kernel };
+
+		if (host_out != NULL) {
+			download_queue.enqueueMapBuffer(buffer_output, CL_FALSE, CL_MAP_READ, 0, image_size, &dependencies, &image_events.enhance_read); // zero-copy, the image is already in output
+			host_out->mapped = true;
+		}
+		else {
+			download_queue.enqueueReadBuffer(buffer_output, CL_FALSE, 0, image_size, output, &dependencies, &image_events.enhance_read); // non-blocking, the caller waits on enhance_read
+		}
+
+		// start the other two queues, each waits on events from the others
+		queue.flush();
+		download_queue.flush();
+
+		slot_events[slot] = image_events;
+		return image_events;
+	}
+
+	// Whether an image of image_size pixels is too large for whole-image buffers, so equalize streams it in strips
+	bool streams(size_t image_size) const {
+		return image_size > options.strip_size;
+	}
+
+	// Equalise an image too large for whole-image buffers in two passes over strips of whole rows of row_size pixels. Every
+	// strip is uploaded and added to one histogram, the look up table is built once, then every strip is uploaded again,
+	// projected and downloaded. Two strip buffers take turns, so the upload of one strip overlaps the kernel of the strip
+	// before it and the download of the strip before that. Blocks until output has been written.
+	// The histogram, scans and look up table count in int, so images of more than INT_MAX pixels are refused rather than
+	// equalised with a wrapped total; -out_of_core counts them in 64 bits on the host.
+	HistEqEvents equalize_streamed(const unsigned char* input, unsigned char* output, size_t image_size, size_t row_size) {
+		if (image_size > (size_t)INT_MAX)
+			throw cl::Error(CL_INVALID_BUFFER_SIZE, "equalize: more than INT_MAX pixels overflow the device histogram, use -out_of_core");
+
+		size_t histogram_size = options.bin_size * sizeof(int);
+		HistEqEvents image_events;
+
+		// four strip buffers live at once, so they may not take more than half the device memory
+		size_t strip_limit = std::min(options.strip_size, (size_t)(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 8));
+		size_t strip_pixels = (row_size <= strip_limit) ? (strip_limit / row_size) * row_size : strip_limit; // whole rows when a row fits
+		size_t strip_count = (image_size + strip_pixels - 1) / strip_pixels;
+		HistEqTuning tuning = launch_tuning(strip_pixels);
+
+		cl::Buffer strip_input[2] = { buffer("strip_input_0", strip_pixels, CL_MEM_READ_ONLY), buffer("strip_input_1", strip_pixels, CL_MEM_READ_ONLY) };
+		cl::Buffer strip_output[2] = { buffer("strip_output_0", strip_pixels, CL_MEM_WRITE_ONLY), buffer("strip_output_1", strip_pixels, CL_MEM_WRITE_ONLY) };
+		cl::Buffer& buffer_histogram = buffer("histogram", histogram_size, CL_MEM_READ_WRITE);
+		cl::Buffer& buffer_lut = buffer("lut", histogram_size, CL_MEM_READ_WRITE);
+
+		image_events.strips.resize(strip_count);
+		for (size_t i = 0; i < strip_count; i++)
+			image_events.strips[i].pixels = std::min(strip_pixels, image_size - i * strip_pixels);
+
+		/////////// First pass - histogram of every strip //////////////////////////////////////////////////////////////////////////
+
+		cl::Event cleared;
+		queue.enqueueFillBuffer(buffer_histogram, 0, 0, histogram_size, NULL, &cleared); // every strip adds to the same histogram
+
+		for (size_t i = 0; i < strip_count; i++) {
+			StripEvents& strip = image_events.strips[i];
+
+			std::vector<cl::Event> buffer_free; // the histogram kernel two strips back has finished reading this buffer
+			if (i >= 2)
+				buffer_free.push_back(image_events.strips[i - 2].hist_kernel);
+			upload_queue.enqueueWriteBuffer(strip_input[i % 2], CL_FALSE, 0, strip.pixels, input + i * strip_pixels, &buffer_free, &strip.write);
+			upload_queue.flush();
+
+			std::vector<cl::Event> ready = { strip.write, cleared };
+			enqueue_hist(strip_input[i % 2], buffer_histogram, strip.pixels, tuning, &ready, &strip.hist_kernel);
+			queue.flush(); // the next uploads wait on this kernel
+		}
+
+		std::vector<cl::Event> dependencies = { image_events.strips.back().hist_kernel }; // in order after every other strip
+		enqueue_lut(buffer_histogram, buffer_lut, dependencies, image_events);
+
+		/////////// Second pass - back projection of every strip ////////////////////////////////////////////////////////////////////
+
+		for (size_t i = 0; i < strip_count; i++) {
+			StripEvents& strip = image_events.strips[i];
+
+			std::vector<cl::Event> buffer_free = { (i >= 2) ? image_events.strips[i - 2].enhance_kernel : image_events.strips.back().hist_kernel };
+			upload_queue.enqueueWriteBuffer(strip_input[i % 2], CL_FALSE, 0, strip.pixels, input + i * strip_pixels, &buffer_free, &strip.second_write);
+			upload_queue.flush();
+
+			std::vector<cl::Event> ready = { strip.second_write, image_events.lut_kernel };
+			if (i >= 2)
+				ready.push_back(image_events.strips[i - 2].enhance_read); // output buffer downloaded
+			enqueue_back_proj(strip_input[i % 2], strip_output[i % 2], buffer_lut, strip.pixels, tuning, &ready, &strip.enhance_kernel);
+			queue.flush();
+
+			std::vector<cl::Event> projected = { strip.enhance_kernel };
+			download_queue.enqueueReadBuffer(strip_output[i % 2], CL_FALSE, 0, strip.pixels, output + i * strip_pixels, &projected, &strip.enhance_read);
+			download_queue.flush();
+		}
+
+		image_events.strips.back().enhance_read.wait(); // downloads complete in order
+		return image_events;
+	}
+
+	// Page-aligned host memory behind the input buffer of a pipeline slot, or NULL when zero-copy is off. Decoding an image
+	// straight into it and passing it to enqueue_equalize replaces the upload with an unmap, which is free on a device that
+	// shares host memory. Waits until the last image on the slot has finished reading it.
+	unsigned char* host_input(size_t image_size, int slot) {
+		if (!zero_copy)
+			return NULL;
+
+		HostBuffer& host = host_buffer("image_input_" + std::to_string(slot), image_size, CL_MEM_READ_ONLY);
+		if (!host.mapped) {
+			std::vector<cl::Event> input_free;
+			if (((size_t)slot < slot_events.size()) && (slot_events[slot].enhance_kernel() != NULL))
+				input_free.push_back(slot_events[slot].enhance_kernel);
+			upload_queue.enqueueMapBuffer(host.buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, image_size, &input_free); // same pointer, the buffer uses host memory
+			host.mapped = true;
+		}
+		return host.memory.get();
+	}
+
+	// Page-aligned host memory the device writes the output image of a pipeline slot into, or NULL when zero-copy is off.
+	// Passed as the output of enqueue_equalize, the download becomes a map and the image is valid once enhance_read completes.
+	unsigned char* host_output(size_t image_size, int slot) {
+		if (!zero_copy)
+			return NULL;
+		return host_buffer("output_" + std::to_string(slot), image_size, CL_MEM_READ_WRITE).memory.get();
+	}
+
+	// Compare the Hillis-Steele, Blelloch and look-back scans on random histograms of 256, 1024, 4096 and 65536 bins
+	void benchmark_scans() {
+		const int repeats = 20;
+
+		check_multi_level_scans();
+
+		for (int bins : { 256, 1024, 4096, 65536 }) {
+			std::vector<int> input(bins);
+			for (int& value : input)
+				value = rand() % 1000; // plausible bin counts
+
+			std::vector<int> expected(bins);
+			std::partial_sum(input.begin(), input.end(), expected.begin()); // host reference
+
+			cl::Buffer buffer_input(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bins * sizeof(int), &input[0]);
+			cl::Buffer buffer_output(context, CL_MEM_READ_WRITE, bins * sizeof(int));
+
+			for (const string scan_mode : { "hs", "bl", "lb" }) {
+				size_t block_limit = scan_block_limit(scan_mode);
+				unsigned long long total_time = 0;
+
+				for (int r = -1; r < repeats; r++) { // first run is a warm-up and is not timed
+					std::vector<cl::Event> scan_events;
+					if (scan_mode == "lb")
+						enqueue_scan_lookback(buffer_input, buffer_output, bins, NULL, scan_events, block_limit);
+					else
+						enqueue_scan(buffer_input, buffer_output, bins, scan_mode, NULL, scan_events, block_limit);
+					queue.finish();
+
+					if (r >= 0) {
+						for (cl::Event& event : scan_events)
+							total_time += event_time(event);
+					}
+				}
+
+				std::vector<int> output(bins);
+				queue.enqueueReadBuffer(buffer_output, CL_TRUE, 0, bins * sizeof(int), &output[0]);
+
+				std::cout << "Scan " << scan_mode << ", " << bins << " bins: " << total_time / repeats << " ns"
+					<< (output == expected ? "" : " (INCORRECT)") << std::endl;
+			}
+		}
+	}
+
+	// Sweep the launch configuration for images of image_input's size class. The histogram kernel tries work-group sizes from
+	// its preferred multiple up to CL_KERNEL_WORK_GROUP_SIZE, and hist_vector also tries strip lengths, then back_proj tries
+	// the driver's choice and the same range of sizes. The fastest of each, by kernel time, is kept for this engine and saved
+	// to options.tuning_file, which later engines on the same device load at startup.
+	HistEqTuning autotune(const CImg<unsigned char>& image_input, int repeats = 5) {
+		size_t image_size = image_input.size();
+		string size_class = TuningSizeClass(image_size);
+
+		tunings.erase(size_class);
+		CImg<unsigned char> expected = equalize(image_input); // default configuration as the reference
+
+		HistEqTuning best;
+		std::cout << "Tuning for " << size_class << " images (" << image_input.width() << "x" << image_input.height() << ")" << std::endl;
+
+		// best kernel time of one stage over the repeats with the candidate in tunings, after a warm-up run
+		auto time_stage = [&](const HistEqTuning& candidate, cl::Event HistEqEvents::* stage, bool& correct) {
+			tunings[size_class] = candidate;
+			unsigned long long best_time = 0;
+			for (int r = -1; r < repeats; r++) {
+				CImg<unsigned char> output = equalize(image_input);
+				unsigned long long time = event_time(events.*stage);
+				if ((r == 0) || ((r > 0) && (time < best_time)))
+					best_time = time;
+				correct = (output == expected);
+			}
+			return best_time;
+		};
+
+		// work-group sizes worth trying for a kernel, doubling from its preferred multiple
+		auto local_sizes = [&](const cl::Kernel& kernel, size_t smallest) {
+			std::vector<size_t> sizes;
+			size_t multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+			size_t largest = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+			for (size_t local_size = multiple; local_size <= largest; local_size *= 2) {
+				if (local_size >= smallest)
+					sizes.push_back(local_size);
+			}
+			return sizes;
+		};
+
+		if (options.hist_mode != "global") { // hist launches one work-item per pixel with the driver's work-group size
+			string name = (options.hist_mode == "vector") ? "hist_vector" : "hist_local";
+			std::vector<int> strips = (options.hist_mode == "vector") ? std::vector<int>{ 16, 32, 64, 128, 256 } : std::vector<int>{ 0 };
+			unsigned long long best_time = 0;
+
+			// smaller groups spend more time clearing and merging the bins than counting pixels
+			for (size_t local_size : local_sizes(kernels[name], 32)) {
+				try {
+					if (hist_kernel(name, local_size).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) < local_size)
+						break; // CL_KERNEL_WORK_GROUP_SIZE, the kernel's registers or local memory allow no more
+				}
+				catch (const cl::Error&) {
+					break; // no specialised build for this size
+				}
+
+				for (int strip : strips) {
+					HistEqTuning candidate = best;
+					candidate.hist_local_size = (int)local_size;
+					candidate.pixels_per_item = strip;
+
+					bool correct;
+					unsigned long long time = time_stage(candidate, &HistEqEvents::hist_kernel, correct);
+					std::cout << "- " << name << " local size " << local_size;
+					if (strip > 0)
+						std::cout << ", " << strip << " pixels per item";
+					std::cout << ": " << time << " ns" << (correct ? "" : " (INCORRECT)") << std::endl;
+
+					if (correct && ((best_time == 0) || (time < best_time))) {
+						best_time = time;
+						best.hist_local_size = candidate.hist_local_size;
+						best.pixels_per_item = candidate.pixels_per_item;
+					}
+				}
+			}
+		}
+
+		std::vector<size_t> back_proj_sizes = local_sizes(kernels["back_proj"], 1);
+		size_t back_proj_max = kernels["back_proj"].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		back_proj_sizes.insert(back_proj_sizes.begin(), 0); // the driver's choice
+		unsigned long long best_time = 0;
+
+		for (size_t local_size : back_proj_sizes) {
+			if ((local_size > back_proj_max) || ((local_size > 0) && (image_size % local_size != 0)))
+				continue; // back_proj has no bounds check, only sizes that divide the image
+
+			HistEqTuning candidate = best;
+			candidate.back_proj_local_size = (int)local_size;
+
+			bool correct;
+			unsigned long long time = time_stage(candidate, &HistEqEvents::enhance_kernel, correct);
+			std::cout << "- back_proj local size " << (local_size ? std::to_string(local_size) : "driver") << ": " << time << " ns" << (correct ? "" : " (INCORRECT)") << std::endl;
+
+			if (correct && ((best_time == 0) || (time < best_time))) {
+				best_time = time;
+				best.back_proj_local_size = candidate.back_proj_local_size;
+			}
+		}
+
+		tunings[size_class] = best;
+		std::cout << "Best: hist local size " << best.hist_local_size << ", " << best.pixels_per_item << " pixels per item, back_proj local size "
+			<< best.back_proj_local_size << " (0 is the default)" << std::endl;
+
+		if (!options.tuning_file.empty() && SaveTuning(options.tuning_file, tuning_key(), size_class, best))
+			std::cout << "Saved to " << options.tuning_file << std::endl;
+
+		return best;
+	}
+
+	// Peak bandwidths of this device - the copy_probe kernel between two device buffers, and writes and reads of the same
+	// buffer from ordinary host memory like the image transfers use. Best of repeats on buffers of up to bytes.
+	BandwidthPeaks measure_bandwidth(size_t bytes = 64 << 20, int repeats = 10) {
+		size_t max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		if (bytes > max_alloc)
+			bytes = max_alloc;
+		bytes = (bytes / 16) * 16; // whole uint4 per work-item
+
+		std::vector<unsigned char> host_memory(bytes, 1);
+		cl::Buffer buffer_a(context, CL_MEM_READ_WRITE, bytes);
+		cl::Buffer buffer_b(context, CL_MEM_READ_WRITE, bytes);
+		cl::Kernel& kernel = kernels["copy_probe"];
+		kernel.setArg(0, buffer_a);
+		kernel.setArg(1, buffer_b);
+
+		BandwidthPeaks peaks;
+		for (int r = -1; r < repeats; r++) { // first run is a warm-up and is not timed
+			cl::Event upload, copy, download;
+			queue.enqueueWriteBuffer(buffer_a, CL_FALSE, 0, bytes, &host_memory[0], NULL, &upload);
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(bytes / 16), cl::NullRange, NULL, &copy);
+			queue.enqueueReadBuffer(buffer_b, CL_TRUE, 0, bytes, &host_memory[0], NULL, &download);
+
+			if (r < 0)
+				continue;
+
+			auto best = [](double& peak, double moved, unsigned long long time) {
+				if ((time > 0) && (moved / time > peak))
+					peak = moved / time; // bytes per ns is GB/s
+			};
+			best(peaks.upload, (double)bytes, event_time(upload));
+			best(peaks.copy, 2.0 * bytes, event_time(copy)); // read and written
+			best(peaks.download, (double)bytes, event_time(download));
+		}
+
+		return peaks;
+	}
+
+	// Execution time of a profiled command in ns, zero for a command that was never enqueued
+	static unsigned long long event_time(const cl::Event& event) {
+		if (event() == NULL)
+			return 0;
+		return event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	}
+
+	// Pixel value to histogram bin table, shared by the histogram kernels and back_proj so they always agree.
+	// Values that would round up past the last bin are clamped into it.
+	static std::vector<int> make_bin_map(int bin_size, int max_intensity) {
+		std::vector<int> bin_map(max_intensity);
+
+		for (int pix = 0; pix < max_intensity; pix++) {
+			int bin_index = (int)std::round((float)pix / (float)max_intensity * bin_size); // same scaling the kernels used to do per pixel
+			bin_map[pix] = (bin_index < bin_size) ? bin_index : bin_size - 1;
+		}
+
+		return bin_map;
+	}
+
+	const HistEqOptions& get_options() const { return options; } // options after adjusting to the device
+	const HistEqEvents& get_events() const { return events; } // events of the last equalize call
+	const cl::Context& get_context() const { return context; }
+	const cl::Device& get_device() const { return device; }
+
+private:
+	HistEqOptions options;
+	cl::Context context;
+	cl::Device device;
+	cl::CommandQueue queue; // kernels and debug reads
+	cl::CommandQueue upload_queue, download_queue; // image transfers
+	cl::Program program;
+	std::map<string, cl::Kernel> kernels; // every kernel in the program, created once
+	string source, hist_build_options; // for programs built with other histogram work-group sizes
+	std::map<size_t, cl::Program> hist_programs; // by HIST_GROUP_SIZE, built on first use
+	std::map<std::pair<string, size_t>, cl::Kernel> hist_kernels; // histogram kernels of hist_programs by name and work-group size
+	std::map<string, HistEqTuning> tunings; // launch sizes for this device by image size class
+	// Device buffer and its size in bytes, which may be more than the current image needs
+	struct DeviceBuffer {
+		cl::Buffer buffer;
+		size_t size = 0;
+	};
+	std::map<string, DeviceBuffer> buffers; // device buffers by role
+	cl::Buffer buffer_bin_map;
+	size_t scan_block_size; // largest block one work-group scans with options.scan_mode
+	size_t hist_group_size; // work-group size the local histogram kernels were built for, 0 when not specialised
+	HistEqEvents events;
+	bool zero_copy; // image buffers may wrap host memory, see host_input and host_output
+	std::vector<HistEqEvents> slot_events; // last image enqueued on each pipeline slot
+
+	// Image buffer over page-aligned host memory, so a device sharing host memory reads and writes it in place.
+	// The memory is declared first so it outlives the buffer.
+	struct HostBuffer {
+		std::unique_ptr<unsigned char, void (*)(void*)> memory;
+		cl::Buffer buffer;
+		size_t size; // bytes, which may be more than the current image needs
+		bool mapped; // the host currently owns the memory
+	};
+	std::map<string, HostBuffer> host_buffers; // by role, like buffers
+
+	static void aligned_free(void* memory) {
+#ifdef _WIN32
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+
+	// Host buffer for the given role of at least size bytes, grown like buffer. The device may still be reading or writing
+	// the old memory, so every queue is drained before it is freed - only ever for a larger image than any before it.
+	HostBuffer& host_buffer(const string& name, size_t size, cl_mem_flags flags) {
+		auto found = host_buffers.find(name);
+		if ((found != host_buffers.end()) && (found->second.size < size)) {
+			if (found->second.mapped)
+				queue.enqueueUnmapMemObject(found->second.buffer, found->second.memory.get());
+			queue.finish();
+			upload_queue.finish();
+			download_queue.finish();
+			host_buffers.erase(found);
+			found = host_buffers.end();
+		}
+
+		if (found == host_buffers.end()) {
+			const size_t page = 4096; // zero-copy needs page-aligned memory on Intel runtimes, and whole cache lines
+			size_t padded_size = ((size + page - 1) / page) * page;
+#ifdef _WIN32
+			void* memory = _aligned_malloc(padded_size, page);
+#else
+			void* memory = NULL;
+			if (posix_memalign(&memory, page, padded_size) != 0)
+				memory = NULL;
+#endif
+			if (memory == NULL)
+				throw cl::Error(CL_OUT_OF_HOST_MEMORY, "host_buffer");
+
+			HostBuffer host = { std::unique_ptr<unsigned char, void (*)(void*)>((unsigned char*)memory, aligned_free), cl::Buffer(), size, false };
+			host.buffer = cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, size, memory);
+			found = host_buffers.emplace(name, std::move(host)).first;
+		}
+		return found->second;
+	}
+
+	// Host buffer behind the given pointer, or NULL when the caller passed its own memory and the buffers must be copied
+	HostBuffer* find_host_buffer(const string& name, size_t size, const void* memory) {
+		auto found = host_buffers.find(name);
+		if ((found == host_buffers.end()) || (found->second.size < size) || (found->second.memory.get() != memory))
+			return NULL;
+		return &found->second;
+	}
+
+	// Buffer for the given role of at least size bytes, allocated on first use and reused by every later image that fits.
+	// A larger image replaces it; commands already enqueued on the old buffer keep it alive until they finish.
+	cl::Buffer& buffer(const string& name, size_t size, cl_mem_flags flags) {
+		DeviceBuffer& found = buffers[name];
+		if (found.size < size) {
+			found.buffer = cl::Buffer(); // release first, so the old and new buffers need not both fit
+			found.buffer = cl::Buffer(context, flags, size);
+			found.size = size;
+		}
+		return found.buffer;
+	}
+
+	// Source of the named kernel file - read from file_name when one is given (kernel development), otherwise taken from the
+	// copy embedded at build time, so the executable does not depend on the working directory
+	static string kernel_source(const string& name, const string& file_name) {
+		if (file_name.empty()) {
+#ifdef HAS_EMBEDDED_KERNELS
+			for (const EmbeddedKernel& kernel : embedded_kernels) {
+				if (name == kernel.name)
+					return kernel.source;
+			}
+#endif
+			return kernel_source(name, "kernels/" + name); // not embedded in this build
+		}
+
+		ifstream file(file_name);
+		if (!file) {
+			std::cerr << "Cannot open kernel file " << file_name << std::endl;
+			throw cl::Error(CL_INVALID_VALUE, "kernel_source"); // cl::Error keeps the pointer, so only a literal is safe here
+		}
+		return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+	}
+
+	// Histogram kernel of options.hist_mode over the first pixel_count pixels of input, adding into histogram once wait_events
+	// complete
+	void enqueue_hist(const cl::Buffer& input, const cl::Buffer& histogram, size_t pixel_count, const HistEqTuning& tuning, const std::vector<cl::Event>* wait_events, cl::Event* event) {
+		int bin_size = options.bin_size;
+		size_t histogram_size = bin_size * sizeof(int);
+
+		if (options.hist_mode == "local") {
+			size_t local_size = hist_local_size("hist_local", tuning);
+			cl::Kernel& kernel = hist_kernel("hist_local", local_size); // privatised hist kernel
+			size_t global_size = ((pixel_count + local_size - 1) / local_size) * local_size; // pad to a whole number of groups
+
+			kernel.setArg(0, input); // set appropriate arguements (arrays start at 0)
+			kernel.setArg(1, histogram);
+			kernel.setArg(2, cl::Local(hist_group_size ? sizeof(int) : histogram_size)); // one sub-histogram per work-group, static when specialised
+			kernel.setArg(3, buffer_bin_map);
+			kernel.setArg(4, bin_size);
+			kernel.setArg(5, (int)pixel_count); // real pixel count, global size may be padded
+
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size), wait_events, event);
+		}
+		else if (options.hist_mode == "vector") {
+			size_t local_size = hist_local_size("hist_vector", tuning);
+			cl::Kernel& kernel = hist_kernel("hist_vector", local_size); // vectorised hist kernel
+			int pixels_per_item = (tuning.pixels_per_item > 0) ? tuning.pixels_per_item : options.pixels_per_item;
+
+			// a few groups per compute unit is enough to keep the device busy, the kernel strides over the rest of the image
+			size_t global_size = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4 * local_size;
+			size_t items_needed = (pixel_count + pixels_per_item - 1) / pixels_per_item; // no point launching idle work-items
+			if (items_needed < global_size)
+				global_size = ((items_needed + local_size - 1) / local_size) * local_size;
+
+			kernel.setArg(0, input);
+			kernel.setArg(1, histogram);
+			kernel.setArg(2, cl::Local(hist_group_size ? sizeof(int) : histogram_size));
+			kernel.setArg(3, buffer_bin_map);
+			kernel.setArg(4, bin_size);
+			kernel.setArg(5, (int)pixel_count);
+			kernel.setArg(6, pixels_per_item);
+
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size), wait_events, event);
+		}
+		else {
+			cl::Kernel& kernel = kernels["hist"]; // global atomics hist kernel
+			kernel.setArg(0, input);
+			kernel.setArg(1, histogram);
+			kernel.setArg(2, buffer_bin_map);
+
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(pixel_count), cl::NullRange, wait_events, event);
+		}
+	}
+
+	// Cumulative histogram, normalisation and look up table from buffer_histogram into buffer_lut, fused or as separate
+	// kernels, with the debug reads of each stage. Waits on dependencies and leaves them holding the look up table event.
+	void enqueue_lut(const cl::Buffer& buffer_histogram, const cl::Buffer& buffer_lut, std::vector<cl::Event>& dependencies, HistEqEvents& image_events) {
+		int bin_size = options.bin_size;
+		size_t histogram_size = bin_size * sizeof(int);
+
+		if (options.fuse_lut) {
+			// scan, normalise by the total and scale in one launch - nothing comes back to the host in between
+			cl::Kernel& kernel = kernels["hist_lut"];
+			kernel.setArg(0, buffer_histogram);
+			kernel.setArg(1, buffer_lut);
+			kernel.setArg(2, cl::Local(histogram_size)); // size for scratch 1
+			kernel.setArg(3, cl::Local(histogram_size)); // size for scratch 2
+			kernel.setArg(4, bin_size);
+
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(bin_size), cl::NDRange(bin_size), &dependencies, &image_events.lut_kernel); // whole histogram in one work-group
+		}
+		else {
+			cl::Buffer& buffer_cumulative_histogram = buffer("cumulative_histogram", histogram_size, CL_MEM_READ_WRITE); // create output buffer for cumulative histogram
+
+			if (options.scan_mode == "lb")
+				enqueue_scan_lookback(buffer_histogram, buffer_cumulative_histogram, bin_size, &dependencies, image_events.cumulative_kernels); // single launch for any bin size
+			else
+				enqueue_scan(buffer_histogram, buffer_cumulative_histogram, bin_size, options.scan_mode, &dependencies, image_events.cumulative_kernels); // multi-level when bin_size exceeds one work-group
+
+			dependencies = { image_events.cumulative_kernels.back() };
+
+			if (options.debug) {
+				std::vector<int> cumulative_histogram(bin_size);
+				queue.enqueueReadBuffer(buffer_cumulative_histogram, CL_TRUE, 0, histogram_size, &cumulative_histogram[0], &dependencies, &image_events.cumulative_read); // read cumulative histogram
+
+				std::cout << "Cumulative histogram = " << cumulative_histogram << std::endl << std::endl; // display for debug purposes
+			}
+
+			size_t norm_histogram_size = bin_size * sizeof(float); // size of normalised histogram vector
+			cl::Buffer& buffer_norm_histogram = buffer("norm_histogram", norm_histogram_size, CL_MEM_READ_WRITE); // buffer for normalised histogram result
+
+			cl::Kernel& kernel = kernels["normalise_array"];
+			kernel.setArg(0, buffer_cumulative_histogram); // set args
+			kernel.setArg(1, buffer_norm_histogram);
+			kernel.setArg(2, bin_size); // the kernel takes the max from the last bin itself
+
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(bin_size), cl::NullRange, &dependencies, &image_events.norm_kernel); // begin normalisation task
+
+			dependencies = { image_events.norm_kernel };
+
+			if (options.debug) {
+				std::vector<float> norm_histogram(bin_size);
+				queue.enqueueReadBuffer(buffer_norm_histogram, CL_TRUE, 0, norm_histogram_size, &norm_histogram[0], &dependencies, &image_events.norm_read); // read normalisation buffer
+
+				std::cout << "Normalised histogram = " << norm_histogram << std::endl << std::endl; // display for debug purposes
+			}
+
+			cl::Kernel& lut_kernel = kernels["lut"];
+			lut_kernel.setArg(0, buffer_norm_histogram); // set args
+			lut_kernel.setArg(1, buffer_lut);
+
+			queue.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(bin_size), cl::NullRange, &dependencies, &image_events.lut_kernel); // begin lut task, one work-item per bin
+		}
+
+		dependencies = { image_events.lut_kernel };
+
+		if (options.debug) {
+			std::vector<int> lut(bin_size); // look up table
+			queue.enqueueReadBuffer(buffer_lut, CL_TRUE, 0, histogram_size, &lut[0], &dependencies, &image_events.lut_read); // read the lut buffer
+
+			std::cout << "Look up table = " << lut << std::endl << std::endl; // display for debug purposes
+		}
+	}
+
+	// back_proj over the first pixel_count pixels of input into output through lut, once wait_events complete
+	void enqueue_back_proj(const cl::Buffer& input, const cl::Buffer& output, const cl::Buffer& lut, size_t pixel_count, const HistEqTuning& tuning, const std::vector<cl::Event>* wait_events, cl::Event* event) {
+		cl::Kernel& kernel = kernels["back_proj"];
+		kernel.setArg(0, input); // set args
+		kernel.setArg(1, output);
+		kernel.setArg(2, lut);
+		kernel.setArg(3, buffer_bin_map); // same mapping the histogram was built with
+
+		// back_proj has no bounds check, so a tuned work-group size is only used when it divides the image
+		size_t back_proj_local_size = tuning.back_proj_local_size;
+		cl::NDRange back_proj_range = ((back_proj_local_size > 0) && (pixel_count % back_proj_local_size == 0)) ? cl::NDRange(back_proj_local_size) : cl::NullRange;
+
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(pixel_count), back_proj_range, wait_events, event); // begin enhancement kernel
+	}
+
+	// Work-group size for hist_local and hist_vector - the tuned size when there is one, then the size the build was specialised
+	// for, otherwise the largest the kernel allows up to 256, enough work-items to clear and merge the bins while small enough
+	// to keep occupancy
+	size_t hist_local_size(const string& name, const HistEqTuning& tuning) {
+		size_t max_size = kernels[name].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+
+		if ((tuning.hist_local_size > 0) && ((hist_group_size != 0) || ((size_t)tuning.hist_local_size <= max_size)))
+			return tuning.hist_local_size; // a specialised build of that size is checked by autotune
+		if (hist_group_size != 0)
+			return hist_group_size;
+		return (max_size > 256) ? 256 : max_size;
+	}
+
+	// Histogram kernel for work-groups of local_size. Specialised kernels have their work-group size built in, so any other
+	// size comes from a program of its own, built (or loaded from the cache) the first time it is needed.
+	cl::Kernel& hist_kernel(const string& name, size_t local_size) {
+		if ((hist_group_size == 0) || (local_size == hist_group_size))
+			return kernels[name];
+
+		std::pair<string, size_t> key(name, local_size);
+		auto found = hist_kernels.find(key);
+		if (found == hist_kernels.end()) {
+			cl::Program& hist_program = hist_programs[local_size];
+			if (hist_program() == NULL)
+				hist_program = BuildProgramCached(context, device, source, hist_build_options + " -D HIST_GROUP_SIZE=" + std::to_string(local_size), options.cache_dir);
+			found = hist_kernels.emplace(key, cl::Kernel(hist_program, name.c_str())).first;
+		}
+		return found->second;
+	}
+
+	// Device, driver and kernel variant the tuned sizes were measured with, so they are never used with anything else
+	string tuning_key() {
+		return device.getInfo<CL_DEVICE_NAME>() + "|" + device.getInfo<CL_DRIVER_VERSION>() + "|" + options.hist_mode + "|" + std::to_string(options.bin_size)
+			+ (options.specialise ? "" : "|generic");
+	}
+
+	HistEqTuning launch_tuning(size_t image_size) {
+		auto found = tunings.find(TuningSizeClass(image_size));
+		return (found != tunings.end()) ? found->second : HistEqTuning();
+	}
+
+	// Largest number of values one work-group can scan with the chosen scan kernel ("hs" Hillis-Steele, "bl" Blelloch or
+	// "lb" decoupled look-back), limited by the kernel work-group size and by local memory.
+	size_t scan_block_limit(const string& scan_mode) {
+		size_t local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+		if (scan_mode == "bl") {
+			size_t max_local = kernels["hist_cumulative_bl"].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+			size_t local_size = 1;
+			while ((local_size * 2 <= max_local) && ((local_size * 4 + local_size * 4 / 32) * sizeof(int) <= local_mem))
+				local_size *= 2; // power of two, two values per work-item plus bank padding
+			return local_size * 2;
+		}
+
+		size_t block_size = kernels[(scan_mode == "lb") ? "hist_cumulative_lb" : "hist_cumulative"].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		if (block_size > local_mem / (2 * sizeof(int)))
+			block_size = local_mem / (2 * sizeof(int)); // two scratch arrays of one block each
+		return block_size;
+	}
+
+	// Check the recursive path of enqueue_scan against the host. Blocks of 32 values over 2055 values give three levels
+	// - 65 blocks, 3 block totals, 1 - with the last block of every level only partly filled.
+	bool check_multi_level_scans() {
+		const size_t block_limit = 32;
+		const int n = (int)(block_limit * block_limit * 2 + 7);
+		bool all_correct = true;
+
+		std::vector<int> input(n);
+		for (int& value : input)
+			value = rand() % 1000;
+
+		std::vector<int> expected(n);
+		std::partial_sum(input.begin(), input.end(), expected.begin());
+
+		cl::Buffer buffer_input(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(int), &input[0]);
+		cl::Buffer buffer_output(context, CL_MEM_READ_WRITE, n * sizeof(int));
+
+		for (const string scan_mode : { "hs", "bl" }) {
+			std::vector<cl::Event> scan_events;
+			enqueue_scan(buffer_input, buffer_output, n, scan_mode, NULL, scan_events, block_limit);
+
+			std::vector<int> output(n);
+			queue.enqueueReadBuffer(buffer_output, CL_TRUE, 0, n * sizeof(int), &output[0]);
+
+			bool correct = (output == expected);
+			all_correct = all_correct && correct;
+			std::cout << "Multi-level scan " << scan_mode << ", " << n << " values in blocks of " << block_limit << ", " << scan_events.size()
+				<< " launches: " << (correct ? "correct" : "INCORRECT") << std::endl;
+		}
+
+		return all_correct;
+	}
+
+	// Inclusive scan of n values using hist_cumulative or hist_cumulative_bl. When n is larger than block_limit each block is scanned
+	// on its own, the block totals are scanned recursively and scan_add_adjust adds them back onto the blocks that follow.
+	// The first launch waits on wait_events, every later one on the launch before it; all launch events are appended to scan_events.
+	void enqueue_scan(const cl::Buffer& input, const cl::Buffer& output, int n, const string& scan_mode, const std::vector<cl::Event>* wait_events, std::vector<cl::Event>& scan_events, size_t block_limit = 0, int level = 0) {
+		if (block_limit == 0)
+			block_limit = scan_block_size;
+
+		size_t block_size = block_limit;
+		size_t local_size;
+		cl::Kernel kernel;
+
+		if (scan_mode == "bl") {
+			while ((block_size / 2 >= (size_t)n) && (block_size > 2))
+				block_size /= 2; // smallest power of two block holding the whole input
+			local_size = block_size / 2;
+
+			kernel = kernels["hist_cumulative_bl"];
+			kernel.setArg(0, input);
+			kernel.setArg(1, output);
+			kernel.setArg(2, cl::Local((block_size + block_size / 32) * sizeof(int))); // one scratch array with bank conflict padding
+			kernel.setArg(3, n);
+		}
+		else {
+			if ((size_t)n <= block_size)
+				block_size = n; // whole input in a single work-group
+			local_size = block_size;
+
+			kernel = kernels["hist_cumulative"];
+			kernel.setArg(0, input);
+			kernel.setArg(1, output);
+			kernel.setArg(2, cl::Local(block_size * sizeof(int))); // scratch space is one block, not the whole input
+			kernel.setArg(3, cl::Local(block_size * sizeof(int)));
+			kernel.setArg(4, n);
+		}
+
+		size_t block_count = (n + block_size - 1) / block_size;
+
+		scan_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(block_count * local_size), cl::NDRange(local_size), wait_events, &scan_events.back());
+
+		if (block_count == 1)
+			return;
+
+		cl::Buffer& buffer_block_sums = buffer("block_sums_" + std::to_string(level), block_count * sizeof(int), CL_MEM_READ_WRITE); // one total per block
+
+		kernel = kernels["block_sum"];
+		kernel.setArg(0, output);
+		kernel.setArg(1, buffer_block_sums);
+		kernel.setArg(2, (int)block_size);
+		kernel.setArg(3, n);
+
+		std::vector<cl::Event> previous = { scan_events.back() };
+		scan_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(block_count), cl::NullRange, &previous, &scan_events.back());
+
+		previous = { scan_events.back() };
+		enqueue_scan(buffer_block_sums, buffer_block_sums, (int)block_count, scan_mode, &previous, scan_events, block_limit, level + 1); // next level up, in place
+
+		kernel = kernels["scan_add_adjust"];
+		kernel.setArg(0, output);
+		kernel.setArg(1, buffer_block_sums);
+		kernel.setArg(2, (int)block_size);
+		kernel.setArg(3, n);
+
+		previous = { scan_events.back() };
+		scan_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(n), cl::NullRange, &previous, &scan_events.back());
+	}
+
+	// Single launch inclusive scan of n values with hist_cumulative_lb, one tile of up to block_limit values per work-group.
+	// Only the tile status flags need clearing beforehand, which is a fill rather than a kernel launch.
+	void enqueue_scan_lookback(const cl::Buffer& input, const cl::Buffer& output, int n, const std::vector<cl::Event>* wait_events, std::vector<cl::Event>& scan_events, size_t block_limit = 0) {
+		if (block_limit == 0)
+			block_limit = scan_block_size;
+
+		size_t local_size = ((size_t)n < block_limit) ? n : block_limit;
+		size_t tile_count = (n + local_size - 1) / local_size;
+
+		cl::Buffer& buffer_status = buffer("lookback_status", (tile_count + 1) * sizeof(int), CL_MEM_READ_WRITE); // tile counter and one flag per tile
+		cl::Buffer& buffer_values = buffer("lookback_values", tile_count * 2 * sizeof(int), CL_MEM_READ_WRITE); // tile totals and inclusive prefixes
+
+		std::vector<cl::Event> cleared(1);
+		queue.enqueueFillBuffer(buffer_status, 0, 0, (tile_count + 1) * sizeof(int), NULL, &cleared[0]);
+		if (wait_events != NULL)
+			cleared.insert(cleared.end(), wait_events->begin(), wait_events->end()); // the scan also waits on whatever produced its input
+
+		cl::Kernel& kernel = kernels["hist_cumulative_lb"];
+		kernel.setArg(0, input);
+		kernel.setArg(1, output);
+		kernel.setArg(2, buffer_status);
+		kernel.setArg(3, buffer_values);
+		kernel.setArg(4, cl::Local(local_size * sizeof(int)));
+		kernel.setArg(5, cl::Local(local_size * sizeof(int)));
+		kernel.setArg(6, n);
+
+		scan_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(tile_count * local_size), cl::NDRange(local_size), &cleared, &scan_events.back());
+	}
+};
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "HostHistEq.h"
+#include "PnmHeader.h"
+
+// A file mapped into memory one view at a time, so a file larger than memory (or than the address space of a 32-bit
+// build) can be walked through in windows. Writable views are shared with the file, so writes through them land in it.
+class MappedFile {
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	// Open an existing file, read only or read and write. Its size does not change.
+	bool open(const string& file_name, bool read_write) {
+		close();
+		writable = read_write;
+#ifdef _WIN32
+		file = CreateFileA(file_name.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		LARGE_INTEGER length;
+		if ((file == INVALID_HANDLE_VALUE) || !GetFileSizeEx(file, &length)) {
+			close();
+			return false;
+		}
+		file_size = (unsigned long long)length.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			close();
+			return false;
+		}
+#else
+		file = ::open(file_name.c_str(), writable ? O_RDWR : O_RDONLY);
+		struct stat status;
+		if ((file < 0) || (fstat(file, &status) != 0)) {
+			close();
+			return false;
+		}
+		file_size = (unsigned long long)status.st_size;
+#endif
+		return true;
+	}
+
+	// Map length bytes from offset, replacing the previous view. Returns the address of the byte at offset, or NULL.
+	unsigned char* map(unsigned long long offset, size_t length) {
+		unmap();
+
+		unsigned long long start = offset - offset % granularity(); // views start on an allocation boundary
+		size_t lead = (size_t)(offset - start);
+#ifdef _WIN32
+		view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)(start & 0xffffffff), lead + length);
+		if (view == NULL)
+			return NULL;
+#else
+		view = mmap(NULL, lead + length, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, file, (off_t)start);
+		if (view == MAP_FAILED) {
+			view = NULL;
+			return NULL;
+		}
+		madvise(view, lead + length, MADV_SEQUENTIAL); // read ahead, and drop pages behind
+#endif
+		view_length = lead + length;
+		return (unsigned char*)view + lead;
+	}
+
+	// Release the current view. Writes through it are handed to the OS to write back without waiting for them.
+	void unmap() {
+		if (view == NULL)
+			return;
+#ifdef _WIN32
+		if (writable)
+			FlushViewOfFile(view, 0);
+		UnmapViewOfFile(view);
+#else
+		if (writable)
+			msync(view, view_length, MS_ASYNC);
+		munmap(view, view_length);
+#endif
+		view = NULL;
+		view_length = 0;
+	}
+
+	void close() {
+		unmap();
+#ifdef _WIN32
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (file >= 0)
+			::close(file);
+		file = -1;
+#endif
+		file_size = 0;
+	}
+
+	unsigned long long size() const { return file_size; }
+
+	// Views must start at a multiple of this many bytes
+	static size_t granularity() {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity; // 64 KB rather than the page size
+#else
+		return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+#else
+	int file = -1;
+#endif
+	bool writable = false;
+	unsigned long long file_size = 0;
+	void* view = NULL;
+	size_t view_length = 0;
+};
+
+// Wall-clock time of each pass of the last EqualizeOutOfCore call in ns, and how the raster was split
+struct OutOfCoreTimes {
+	unsigned long long hist = 0, lut = 0, back_proj = 0;
+	size_t tile_size = 0; // bytes of the raster per tile
+	unsigned long long tile_count = 0;
+};
+
+// Equalise a binary 8-bit PGM or PPM of any size into output_file without loading it. The input raster is mapped a tile
+// at a time: the first pass counts pixel values into 64-bit totals, so images past 2^31 pixels are counted correctly,
+// and the second maps each input tile beside the same tile of the pre-sized output file and looks every pixel up. No
+// more than about working_set bytes of the two files are mapped at once. The output is the same as equalize would give
+// on the whole image. Returns false, after reporting why, when the input cannot be read or the output written.
+bool EqualizeOutOfCore(HostHistEq& host, const string& input_file, const string& output_file, size_t working_set, OutOfCoreTimes* times = NULL) {
+	typedef std::chrono::steady_clock clock;
+
+	PnmHeader header;
+	if (!ReadPnmHeader(input_file, header) || !header.binary) { // an ASCII raster cannot be mapped
+		std::cerr << input_file << " is not a binary PGM or PPM with 8-bit samples" << std::endl;
+		return false;
+	}
+	unsigned long long raster_size = header.raster_size();
+
+	MappedFile input;
+	if (!input.open(input_file, false) || (input.size() < header.raster_offset + raster_size)) {
+		std::cerr << "Cannot map the raster of " << input_file << std::endl;
+		return false;
+	}
+
+	// header first, then the file is grown to its final size so the raster can be mapped and written in place
+	stringstream output_header;
+	output_header << ((header.channels == 1) ? "P5" : "P6") << "\n" << header.width << " " << header.height << "\n255\n";
+	ofstream(output_file, ios::binary | ios::trunc) << output_header.str();
+	error_code error;
+	std::filesystem::resize_file(output_file, output_header.str().size() + raster_size, error);
+
+	MappedFile output;
+	if (error || !output.open(output_file, true)) {
+		std::cerr << "Cannot create " << output_file << std::endl;
+		return false;
+	}
+
+	// input and output tiles are mapped together, half the working set each, in whole allocation units
+	size_t granularity = MappedFile::granularity();
+	size_t tile_size = std::max(granularity, (working_set / 2) / granularity * granularity);
+	unsigned long long tile_count = (raster_size + tile_size - 1) / tile_size;
+
+	/////////// Calculate histogram ////////////////////////////////////////////////////////////////////////////////////////////
+
+	clock::time_point start = clock::now();
+
+	std::vector<unsigned long long> value_counts(256, 0);
+	for (unsigned long long offset = 0; offset < raster_size; offset += tile_size) {
+		size_t n = (size_t)std::min<unsigned long long>(tile_size, raster_size - offset);
+		unsigned char* pixels = input.map(header.raster_offset + offset, n);
+		if (pixels == NULL) {
+			std::cerr << "Cannot map " << input_file << " at byte " << header.raster_offset + offset << std::endl;
+			return false;
+		}
+		host.count_values(pixels, n, value_counts.data());
+	}
+	input.unmap();
+
+	clock::time_point hist_end = clock::now();
+
+	/////////// Create cumulative histogram, normalise and create look up table //////////////////////////////////////////////////
+
+	unsigned char pixel_table[256];
+	host.make_pixel_table(value_counts.data(), pixel_table);
+
+	clock::time_point lut_end = clock::now();
+
+	/////////// Create enhanced image from LUT ///////////////////////////////////////////////////////////////////////////////////////
+
+	for (unsigned long long offset = 0; offset < raster_size; offset += tile_size) {
+		size_t n = (size_t)std::min<unsigned long long>(tile_size, raster_size - offset);
+		unsigned char* pixels = input.map(header.raster_offset + offset, n);
+		unsigned char* enhanced = output.map(output_header.str().size() + offset, n);
+		if ((pixels == NULL) || (enhanced == NULL)) {
+			std::cerr << "Cannot map tile " << offset / tile_size << " of " << input_file << " and " << output_file << std::endl;
+			return false;
+		}
+		host.apply_pixel_table(pixels, enhanced, n, pixel_table);
+	}
+	input.close();
+	output.close();
+
+	clock::time_point end = clock::now();
+
+	if (times != NULL) {
+		times->hist = std::chrono::duration_cast<std::chrono::nanoseconds>(hist_end - start).count();
+		times->lut = std::chrono::duration_cast<std::chrono::nanoseconds>(lut_end - hist_end).count();
+		times->back_proj = std::chrono::duration_cast<std::chrono::nanoseconds>(end - lut_end).count();
+		times->tile_size = tile_size;
+		times->tile_count = tile_count;
+	}
+	return true;
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <utility>
+
+#include "HistEqEngine.h"
+#include "Report.h"
+
+// One profiled command - what ran, on which queue, its device timestamps and the work it did
+struct CommandProfile {
+	string name; // kernel name, or upload, download and the debug reads
+	string stage; // histogram, look up table or back projection
+	string queue; // upload, kernel or download
+	bool transfer; // host to device or back, rather than a kernel
+	ProfilingTimes times;
+	unsigned long long bytes_read, bytes_written; // global memory, or host memory for transfers, from the buffer sizes
+	unsigned long long ops; // additions, atomic increments, divisions and table lookups, 0 for transfers
+
+	unsigned long long queue_delay() const { return times.submit - times.queued; } // waiting in the host queue
+	unsigned long long submit_delay() const { return times.start - times.submit; } // submitted, waiting for the device
+	unsigned long long execution() const { return times.end - times.start; }
+	unsigned long long bytes() const { return bytes_read + bytes_written; }
+	double bandwidth() const { return execution() ? (double)bytes() / execution() : 0; } // bytes per ns is GB/s
+	double op_rate() const { return execution() ? (double)ops / execution() : 0; } // Gop/s
+	double intensity() const { return bytes() ? (double)ops / bytes() : 0; } // ops per byte, the roofline x axis
+};
+
+// Every command of one equalised image with the QUEUED, SUBMIT, START and END timestamps GetFullProfilingInfo reports,
+// plus host wall-clock times for the work around it (loading, building, saving). Totals are 64-bit - a large image
+// overflows an int of ns.
+class HistEqProfile {
+public:
+	// Commands of one image from the events of HistEqEngine::equalize, labelled with the kernel variants that produced them
+	// Bytes and ops are what each kernel must touch at least - pixels read once, each bin read and written once per pass -
+	// so cache hits on the bin table or look up table do not count.
+	void add_commands(const HistEqEvents& events, const HistEqOptions& options, size_t image_size) {
+		unsigned long long pixels = image_size, bins = options.bin_size, histogram_size = bins * sizeof(int);
+		unsigned long long scan_steps = 0; // Hillis-Steele passes over the bins, also the fused kernel's scan
+		while ((1ULL << scan_steps) < bins)
+			scan_steps++;
+		image_pixels = image_size;
+
+		add(events.write, "upload", "histogram", "upload", true, pixels, 0, 0);
+		add(events.hist_kernel, (options.hist_mode == "global") ? "hist" : "hist_" + options.hist_mode, "histogram", "kernel", false,
+			pixels, histogram_size, pixels); // one increment per pixel, the per-group merges are small beside it
+		for (size_t i = 0; i < events.strips.size(); i++) { // first pass of a streamed image
+			const StripEvents& strip = events.strips[i];
+			add(strip.write, "upload strip " + std::to_string(i), "histogram", "upload", true, strip.pixels, 0, 0);
+			add(strip.hist_kernel, ((options.hist_mode == "global") ? "hist" : "hist_" + options.hist_mode) + " strip " + std::to_string(i), "histogram", "kernel", false,
+				strip.pixels, histogram_size, strip.pixels);
+		}
+		add(events.hist_read, "histogram read", "histogram", "kernel", true, histogram_size, 0, 0);
+		for (size_t i = 0; i < events.cumulative_kernels.size(); i++) // every level of the scan reads and writes the histogram once
+			add(events.cumulative_kernels[i], "scan_" + options.scan_mode + " " + std::to_string(i), "look up table", "kernel", false,
+				histogram_size, histogram_size, (options.scan_mode == "hs") ? bins * scan_steps : 2 * bins);
+		add(events.cumulative_read, "cumulative read", "look up table", "kernel", true, histogram_size, 0, 0);
+		add(events.norm_kernel, "normalise_array", "look up table", "kernel", false, histogram_size, bins * sizeof(float), bins);
+		add(events.norm_read, "normalised read", "look up table", "kernel", true, bins * sizeof(float), 0, 0);
+		if (options.fuse_lut) // scan, divide and scale
+			add(events.lut_kernel, "hist_lut", "look up table", "kernel", false, histogram_size, histogram_size, bins * scan_steps + 2 * bins);
+		else
+			add(events.lut_kernel, "lut", "look up table", "kernel", false, bins * sizeof(float), histogram_size, bins);
+		add(events.lut_read, "look up table read", "look up table", "kernel", true, histogram_size, 0, 0);
+		add(events.enhance_kernel, "back_proj", "back projection", "kernel", false, pixels, pixels, pixels); // one lookup per pixel
+		add(events.enhance_read, "download", "back projection", "download", true, 0, pixels, 0);
+		for (size_t i = 0; i < events.strips.size(); i++) { // second pass of a streamed image
+			const StripEvents& strip = events.strips[i];
+			add(strip.second_write, "upload strip " + std::to_string(i), "back projection", "upload", true, strip.pixels, 0, 0);
+			add(strip.enhance_kernel, "back_proj strip " + std::to_string(i), "back projection", "kernel", false, strip.pixels, strip.pixels, strip.pixels);
+			add(strip.enhance_read, "download strip " + std::to_string(i), "back projection", "download", true, 0, strip.pixels, 0);
+		}
+	}
+
+	// Peak bandwidths to report each command against, from HistEqEngine::measure_bandwidth
+	void set_peaks(const BandwidthPeaks& peak_bandwidth) {
+		peaks = peak_bandwidth;
+	}
+
+	// Host wall-clock time of a step outside the device, in ns
+	void add_host(const string& name, unsigned long long ns) {
+		host_times.push_back(std::make_pair(name, ns));
+	}
+
+	unsigned long long transfer_time() const { return execution_time(true); }
+	unsigned long long kernel_time() const { return execution_time(false); }
+
+	// QUEUED to START summed over every command
+	unsigned long long delay_time() const {
+		unsigned long long total = 0;
+		for (const CommandProfile& command : commands)
+			total += command.queue_delay() + command.submit_delay();
+		return total;
+	}
+
+	// First QUEUED to last END over every command, which is less than the sum of their times when they overlap
+	unsigned long long span() const {
+		if (commands.empty())
+			return 0;
+
+		cl_ulong first = commands[0].times.queued, last = commands[0].times.end;
+		for (const CommandProfile& command : commands) {
+			if (command.times.queued < first) first = command.times.queued;
+			if (command.times.end > last) last = command.times.end;
+		}
+		return last - first;
+	}
+
+	void print(std::ostream& out) const {
+		string stage;
+		for (const CommandProfile& command : commands) {
+			if (command.stage != stage) {
+				stage = command.stage;
+				out << (stage == "histogram" ? "" : "\n") << "Stage: " << stage << std::endl;
+			}
+			out << "- \"" << command.name << "\" on the " << command.queue << " queue (ns): queued " << command.queue_delay() << ", submitted "
+				<< command.submit_delay() << ", executed " << command.execution() << ", " << command.bytes() << " bytes, " << command.bandwidth() << " GB/s";
+			if (peak(command) > 0)
+				out << " (" << 100 * command.bandwidth() / peak(command) << "% of peak)";
+			if (command.ops > 0)
+				out << ", " << command.op_rate() << " Gop/s at " << command.intensity() << " op/byte";
+			out << std::endl;
+		}
+
+		out << std::endl;
+		out << "Memory transfer time (ns): " << transfer_time() << std::endl;
+		out << "Kernel execution time (ns): " << kernel_time() << std::endl;
+		out << "Queued and submitted time (ns): " << delay_time() << std::endl;
+		out << "Total program execution time (ns): " << transfer_time() + kernel_time() << std::endl;
+		out << "First queued to last finished (ns): " << span() << std::endl;
+		for (const std::pair<string, unsigned long long>& host : host_times)
+			out << "Host " << host.first << " time (ns): " << host.second << std::endl;
+
+		if (peaks.copy > 0) {
+			out << std::endl;
+			out << "Peak bandwidth (GB/s): device copy " << peaks.copy << ", upload " << peaks.upload << ", download " << peaks.download << std::endl;
+
+			// every kernel here does far less than one op per byte, so the bandwidth roof is the one that limits them; the
+			// kernel furthest below it, weighted by its time, is the one worth optimising next
+			const CommandProfile* next = NULL;
+			double next_headroom = 0;
+			for (const CommandProfile& command : commands) {
+				double headroom = command.execution() * (1 - command.bandwidth() / peak(command)); // ns lost against the roof
+				if (!command.transfer && (headroom > next_headroom)) {
+					next = &command;
+					next_headroom = headroom;
+				}
+			}
+			if (next != NULL)
+				out << "Furthest below the bandwidth roof: \"" << next->name << "\", " << next_headroom << " ns slower than peak bandwidth allows" << std::endl;
+		}
+	}
+
+	bool write_json(const string& file_name) const {
+		ofstream file(file_name, ios::trunc);
+
+		file << "{\n  \"pixels\": " << image_pixels << ",\n  \"commands\": [";
+		for (size_t i = 0; i < commands.size(); i++) {
+			const CommandProfile& command = commands[i];
+			file << (i ? "," : "") << "\n    { \"name\": " << JsonString(command.name) << ", \"stage\": " << JsonString(command.stage)
+				<< ", \"queue\": " << JsonString(command.queue) << ", \"transfer\": " << (command.transfer ? "true" : "false")
+				<< ", \"queued\": " << command.times.queued << ", \"submit\": " << command.times.submit << ", \"start\": " << command.times.start
+				<< ", \"end\": " << command.times.end << ", \"queue_ns\": " << command.queue_delay() << ", \"submit_ns\": " << command.submit_delay()
+				<< ", \"execution_ns\": " << command.execution() << ", \"bytes_read\": " << command.bytes_read << ", \"bytes_written\": " << command.bytes_written
+				<< ", \"ops\": " << command.ops << ", \"gb_per_s\": " << command.bandwidth() << ", \"gop_per_s\": " << command.op_rate()
+				<< ", \"op_per_byte\": " << command.intensity() << ", \"percent_of_peak\": " << ((peak(command) > 0) ? 100 * command.bandwidth() / peak(command) : 0) << " }";
+		}
+		file << "\n  ],\n  \"totals\": { \"transfer_ns\": " << transfer_time() << ", \"kernel_ns\": " << kernel_time() << ", \"delay_ns\": " << delay_time()
+			<< ", \"total_ns\": " << transfer_time() + kernel_time() << ", \"span_ns\": " << span() << " },\n  \"peak_gb_per_s\": { \"copy\": " << peaks.copy
+			<< ", \"upload\": " << peaks.upload << ", \"download\": " << peaks.download << " },\n  \"host\": {";
+		for (size_t i = 0; i < host_times.size(); i++)
+			file << (i ? "," : "") << " " << JsonString(host_times[i].first + "_ns") << ": " << host_times[i].second;
+		file << " }\n}\n";
+
+		if (!file) {
+			std::cerr << "Cannot write profile " << file_name << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	const std::vector<CommandProfile>& get_commands() const { return commands; }
+
+private:
+	std::vector<CommandProfile> commands; // in pipeline order
+	std::vector<std::pair<string, unsigned long long>> host_times;
+	size_t image_pixels = 0;
+	BandwidthPeaks peaks; // zero until set_peaks
+
+	void add(const cl::Event& event, const string& name, const string& stage, const string& queue, bool transfer,
+		unsigned long long bytes_read, unsigned long long bytes_written, unsigned long long ops) {
+		if (event() == NULL)
+			return; // stage did not run, e.g. debug reads
+		commands.push_back({ name, stage, queue, transfer, GetProfilingTimes(event), bytes_read, bytes_written, ops });
+	}
+
+	// Peak bandwidth a command can reach - the device copy for kernels, the measured transfer for uploads and downloads
+	double peak(const CommandProfile& command) const {
+		if (!command.transfer)
+			return peaks.copy;
+		return (command.queue == "upload") ? peaks.upload : peaks.download; // debug reads are downloads too
+	}
+
+	unsigned long long execution_time(bool transfer) const {
+		unsigned long long total = 0;
+		for (const CommandProfile& command : commands) {
+			if (command.transfer == transfer)
+				total += command.execution();
+		}
+		return total;
+	}
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <type_traits>
+
+#include "HistEqEngine.h"
+#include "HostSimd.h"
+
+// Wall-clock time of each stage of the last HostHistEq::equalize call in ns
+struct HostHistEqTimes {
+	unsigned long long hist = 0, lut = 0, back_proj = 0;
+};
+
+// The same histogram, cumulative histogram, normalisation, look up table and back projection as HistEqEngine, run on
+// the host with std::thread workers. Uses the same bin table and float maths as the kernels, so the output is identical
+// to the OpenCL pipeline's, and needs no OpenCL platform at all. The per-pixel loops use the widest SIMD version the CPU
+// supports, see HostSimd.h.
+class HostHistEq {
+public:
+	HostHistEq(const HistEqOptions& engine_options = HistEqOptions(), unsigned int threads = 0) : options(engine_options) {
+		thread_count = (threads > 0) ? threads : std::thread::hardware_concurrency();
+		if (thread_count == 0)
+			thread_count = 1; // hardware_concurrency may not know
+		bin_map = HistEqEngine::make_bin_map(options.bin_size, options.max_intensity);
+		bin_map.resize(256, options.bin_size - 1); // one entry per 8-bit value, whatever max_intensity says
+
+		isa = DetectHostIsa();
+		if ((options.host_isa != "auto") && (HostIsaFromName(options.host_isa) < isa))
+			isa = HostIsaFromName(options.host_isa); // narrower than the CPU allows, for comparison
+		HostSimdFunctions(isa, histogram_function, apply_lut_function);
+	}
+
+	// Equalise one image. Like the kernels, only 8-bit pixels are handled.
+	template <typename T>
+	CImg<T> equalize(const CImg<T>& image_input) {
+		static_assert(std::is_same<T, unsigned char>::value, "the host pipeline matches the 8-bit OpenCL kernels");
+
+		CImg<T> image_output(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+		equalize(image_input.data(), image_output.data(), image_input.size());
+		return image_output;
+	}
+
+	void equalize(const unsigned char* input, unsigned char* output, size_t image_size) {
+		typedef std::chrono::steady_clock clock;
+
+		/////////// Calculate histogram ////////////////////////////////////////////////////////////////////////////////////////////
+
+		clock::time_point start = clock::now();
+
+		std::vector<unsigned long long> value_counts(256, 0);
+		count_values(input, image_size, value_counts.data());
+
+		clock::time_point hist_end = clock::now();
+
+		/////////// Create cumulative histogram, normalise and create look up table //////////////////////////////////////////////////
+
+		unsigned char pixel_table[256]; // pixel value straight to output value, bin lookup included
+		make_pixel_table(value_counts.data(), pixel_table);
+
+		clock::time_point lut_end = clock::now();
+
+		/////////// Create enhanced image from LUT ///////////////////////////////////////////////////////////////////////////////////////
+
+		apply_pixel_table(input, output, image_size, pixel_table);
+
+		clock::time_point end = clock::now();
+
+		times.hist = std::chrono::duration_cast<std::chrono::nanoseconds>(hist_end - start).count();
+		times.lut = std::chrono::duration_cast<std::chrono::nanoseconds>(lut_end - hist_end).count();
+		times.back_proj = std::chrono::duration_cast<std::chrono::nanoseconds>(end - lut_end).count();
+	}
+
+	// Add the number of times each pixel value occurs in n pixels to counts (256 entries). The counts are 64-bit, so one
+	// image may be counted over many calls, a piece at a time, and total more pixels than an int holds.
+	void count_values(const unsigned char* input, size_t n, unsigned long long* counts) {
+		const size_t block = 1 << 30; // the SIMD loops count in int, so each thread adds up at most this many at a time
+
+		// one private histogram of pixel values per thread, like the per work-group histograms of hist_local, merged once
+		// at the end and only then mapped to bins
+		std::vector<std::vector<unsigned long long>> partial_counts(thread_count, std::vector<unsigned long long>(256, 0));
+		parallel_for(n, [&](unsigned int thread, size_t begin, size_t end) {
+			for (size_t first = begin; first < end; first += block) {
+				int block_counts[256] = { 0 };
+				histogram_function(input + first, std::min(block, end - first), block_counts);
+				for (int v = 0; v < 256; v++)
+					partial_counts[thread][v] += block_counts[v];
+			}
+		});
+
+		for (const std::vector<unsigned long long>& partial : partial_counts) {
+			for (int v = 0; v < 256; v++)
+				counts[v] += partial[v];
+		}
+	}
+
+	// Pixel value to output value table (256 entries) from the pixel value counts of a whole image
+	void make_pixel_table(const unsigned long long* counts, unsigned char* pixel_table) {
+		int bin_size = options.bin_size;
+
+		histogram.assign(bin_size, 0);
+		for (int v = 0; v < 256; v++)
+			histogram[bin_map[v]] += counts[v];
+
+		// a few hundred bins, not worth a thread
+		lut.assign(bin_size, 0);
+		unsigned long long pixel_count = 0;
+		for (int i = 0; i < bin_size; i++)
+			pixel_count += histogram[i];
+		float total = (float)pixel_count; // the kernels divide by the last value of the cumulative histogram
+
+		unsigned long long cumulative = 0;
+		for (int i = 0; i < bin_size; i++) {
+			cumulative += histogram[i];
+			lut[i] = (int)(((float)cumulative / total) * 255); // same single precision maths as hist_lut and normalise_array + lut
+		}
+
+		for (int v = 0; v < 256; v++)
+			pixel_table[v] = (unsigned char)lut[bin_map[v]]; // same conversion as back_proj
+	}
+
+	// Look every one of n pixels up in a table from make_pixel_table
+	void apply_pixel_table(const unsigned char* input, unsigned char* output, size_t n, const unsigned char* pixel_table) {
+		parallel_for(n, [&](unsigned int, size_t begin, size_t end) {
+			apply_lut_function(input + begin, output + begin, end - begin, pixel_table);
+		});
+	}
+
+	unsigned int get_thread_count() const { return thread_count; }
+	HostIsa get_isa() const { return isa; }
+	const HostHistEqTimes& get_times() const { return times; } // stage times of the last equalize call
+	const std::vector<unsigned long long>& get_histogram() const { return histogram; } // histogram of the last image
+	const std::vector<int>& get_lut() const { return lut; } // look up table of the last image
+
+private:
+	HistEqOptions options;
+	unsigned int thread_count;
+	std::vector<int> bin_map; // pixel value to bin, same table the kernels use
+	HostIsa isa; // SIMD version of the per-pixel loops
+	HostHistogramFunction histogram_function;
+	HostApplyLutFunction apply_lut_function;
+	std::vector<unsigned long long> histogram;
+	std::vector<int> lut;
+	HostHistEqTimes times;
+
+	// Run body(thread, begin, end) over [0, n) split into one contiguous chunk per thread. The calling thread takes the
+	// first chunk, and small inputs are not split at all.
+	template <typename F>
+	void parallel_for(size_t n, F body) {
+		const size_t min_chunk = 1 << 16; // below this a thread costs more than it saves
+		unsigned int threads = (unsigned int)std::min<size_t>(thread_count, (n + min_chunk - 1) / min_chunk);
+		if (threads < 2) {
+			body(0, 0, n);
+			return;
+		}
+
+		size_t chunk = (n + threads - 1) / threads;
+		std::vector<std::thread> workers;
+		for (unsigned int t = 1; t < threads; t++)
+			workers.emplace_back(body, t, std::min(n, t * chunk), std::min(n, (t + 1) * chunk));
+
+		body(0, 0, chunk);
+
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+};
+
+// Time the histogram and look up table loops of every ISA this CPU supports on one thread over the given pixels, against
+// the scalar versions, and check that each one gives the scalar result
+void BenchmarkHostSimd(const unsigned char* pixels, size_t n, int repeats = 20) {
+	typedef std::chrono::steady_clock clock;
+
+	unsigned char table[256];
+	for (int v = 0; v < 256; v++)
+		table[v] = (unsigned char)(255 - v); // any table will do
+
+	std::vector<int> expected_counts(256, 0);
+	std::vector<unsigned char> expected_output(n);
+	HostHistogramScalar(pixels, n, expected_counts.data());
+	HostApplyLutScalar(pixels, expected_output.data(), n, table);
+
+	double scalar_hist = 0, scalar_lut = 0;
+	HostIsa widest = DetectHostIsa();
+	std::cout << "Host SIMD benchmark, " << n << " pixels, " << repeats << " repeats, widest ISA " << HostIsaName(widest) << std::endl;
+
+	for (int i = HOST_SCALAR; i <= widest; i++) {
+		HostIsa isa = (HostIsa)i;
+		HostHistogramFunction histogram;
+		HostApplyLutFunction apply_lut;
+		HostSimdFunctions(isa, histogram, apply_lut);
+
+		std::vector<int> counts(256);
+		std::vector<unsigned char> output(n);
+		double hist_time = 0, lut_time = 0; // best of the repeats, in ns per pixel
+
+		for (int r = 0; r < repeats; r++) {
+			std::fill(counts.begin(), counts.end(), 0);
+
+			clock::time_point start = clock::now();
+			histogram(pixels, n, counts.data());
+			clock::time_point middle = clock::now();
+			apply_lut(pixels, output.data(), n, table);
+			clock::time_point end = clock::now();
+
+			double hist_ns = std::chrono::duration<double, std::nano>(middle - start).count() / n;
+			double lut_ns = std::chrono::duration<double, std::nano>(end - middle).count() / n;
+			if ((r == 0) || (hist_ns < hist_time)) hist_time = hist_ns;
+			if ((r == 0) || (lut_ns < lut_time)) lut_time = lut_ns;
+		}
+
+		if (isa == HOST_SCALAR) {
+			scalar_hist = hist_time;
+			scalar_lut = lut_time;
+		}
+
+		std::cout << "- " << HostIsaName(isa) << ": histogram " << hist_time << " ns/pixel (" << scalar_hist / hist_time << "x), look up table "
+			<< lut_time << " ns/pixel (" << scalar_lut / lut_time << "x)"
+			<< (((counts == expected_counts) && (output == expected_output)) ? "" : " (INCORRECT)") << std::endl;
+	}
+}
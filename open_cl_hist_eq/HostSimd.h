@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// x86 SIMD versions of the two per-pixel loops of HostHistEq - the pixel value histogram and the look up table apply.
+// Every version is compiled into the same binary and DetectHostIsa picks one at run time, so the executable still runs on
+// hosts without AVX2 or AVX-512. Each ISA has its own pair of functions with identical results.
+
+#if defined(_M_X64) || defined(__x86_64__) // 64-bit only, the histograms read whole 64-bit words
+#define HOST_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HOST_TARGET(isa) // MSVC allows any intrinsic in any function
+#else
+#include <cpuid.h>
+#define HOST_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+enum HostIsa {
+	HOST_SCALAR,
+	HOST_AVX2,
+	HOST_AVX512 // F, BW and VBMI
+};
+
+inline const char* HostIsaName(HostIsa isa) {
+	switch (isa) {
+	case HOST_AVX2: return "avx2";
+	case HOST_AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+inline HostIsa HostIsaFromName(const std::string& name) {
+	if (name == "avx512") return HOST_AVX512;
+	if (name == "avx2") return HOST_AVX2;
+	return HOST_SCALAR;
+}
+
+// Widest ISA both the CPU and the operating system support
+inline HostIsa DetectHostIsa() {
+#ifdef HOST_SIMD_X86
+	unsigned int regs[4] = { 0, 0, 0, 0 }; // eax, ebx, ecx, edx
+	unsigned int leaf7[4] = { 0, 0, 0, 0 };
+	unsigned long long xcr0 = 0;
+
+#ifdef _MSC_VER
+	__cpuid((int*)regs, 0);
+	unsigned int max_leaf = regs[0];
+	__cpuid((int*)regs, 1);
+	if (max_leaf >= 7)
+		__cpuidex((int*)leaf7, 7, 0);
+	if (regs[2] & (1u << 27)) // OSXSAVE, xgetbv is usable
+		xcr0 = _xgetbv(0);
+#else
+	unsigned int max_leaf = __get_cpuid_max(0, NULL);
+	__cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+	if (max_leaf >= 7)
+		__cpuid_count(7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3]);
+	if (regs[2] & (1u << 27)) {
+		unsigned int xcr0_low, xcr0_high;
+		__asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+		xcr0 = ((unsigned long long)xcr0_high << 32) | xcr0_low;
+	}
+#endif
+
+	bool os_avx = (xcr0 & 0x6) == 0x6; // xmm and ymm state saved on context switch
+	bool os_avx512 = (xcr0 & 0xe6) == 0xe6; // plus opmask and zmm state
+
+	bool avx2 = (leaf7[1] & (1u << 5)) != 0;
+	bool avx512 = ((leaf7[1] & (1u << 16)) != 0) && ((leaf7[1] & (1u << 30)) != 0) && ((leaf7[2] & (1u << 1)) != 0); // F, BW, VBMI
+
+	if (avx512 && os_avx512)
+		return HOST_AVX512;
+	if (avx2 && os_avx)
+		return HOST_AVX2;
+#endif
+	return HOST_SCALAR;
+}
+
+/////////// Histogram of pixel values //////////////////////////////////////////////////////////////////////////////////////////////
+// Each function adds the count of every pixel value of A[0..n) to counts[256]. Mapping values to bins afterwards keeps the
+// bin table out of the inner loop.
+
+inline void HostHistogramScalar(const unsigned char* A, size_t n, int* counts) {
+	for (size_t i = 0; i < n; i++)
+		counts[A[i]]++;
+}
+
+// Runs of equal pixels, common in flat image regions, make every increment wait for the store of the one before it.
+// Spreading consecutive pixels over four sub-histograms breaks that chain; they are summed at the end.
+#define HOST_HIST_ADD_WORD(word) \
+	sub[0][(word) & 0xff]++; sub[1][((word) >> 8) & 0xff]++; sub[2][((word) >> 16) & 0xff]++; sub[3][((word) >> 24) & 0xff]++; \
+	sub[0][((word) >> 32) & 0xff]++; sub[1][((word) >> 40) & 0xff]++; sub[2][((word) >> 48) & 0xff]++; sub[3][(word) >> 56]++;
+
+#ifdef HOST_SIMD_X86
+
+HOST_TARGET("avx2") inline void HostHistogramAvx2(const unsigned char* A, size_t n, int* counts) {
+	int sub[4][256] = {};
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)(A + i)); // one load per 32 pixels, split into words in registers
+		unsigned long long w0 = (unsigned long long)_mm256_extract_epi64(pixels, 0);
+		unsigned long long w1 = (unsigned long long)_mm256_extract_epi64(pixels, 1);
+		unsigned long long w2 = (unsigned long long)_mm256_extract_epi64(pixels, 2);
+		unsigned long long w3 = (unsigned long long)_mm256_extract_epi64(pixels, 3);
+		HOST_HIST_ADD_WORD(w0);
+		HOST_HIST_ADD_WORD(w1);
+		HOST_HIST_ADD_WORD(w2);
+		HOST_HIST_ADD_WORD(w3);
+	}
+
+	for (; i < n; i++)
+		sub[i & 3][A[i]]++;
+
+	for (int v = 0; v < 256; v++)
+		counts[v] += sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+}
+
+#endif
+
+/////////// Look up table apply ////////////////////////////////////////////////////////////////////////////////////////////////////
+// Each function writes O[i] = table[A[i]] for i in [0, n), where table holds 256 output pixel values.
+
+inline void HostApplyLutScalar(const unsigned char* A, unsigned char* O, size_t n, const unsigned char* table) {
+	for (size_t i = 0; i < n; i++)
+		O[i] = table[A[i]];
+}
+
+#ifdef HOST_SIMD_X86
+
+// AVX2 has no byte shuffle over more than 16 entries, so the table is widened to ints and read with gathers, 8 pixels each
+HOST_TARGET("avx2") inline void HostApplyLutAvx2(const unsigned char* A, unsigned char* O, size_t n, const unsigned char* table) {
+	alignas(32) int wide_table[256];
+	for (int v = 0; v < 256; v++)
+		wide_table[v] = table[v];
+
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7); // undoes the per-lane interleave of the packs
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_i32gather_epi32(wide_table, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(A + i))), 4);
+		__m256i b = _mm256_i32gather_epi32(wide_table, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(A + i + 8))), 4);
+		__m256i c = _mm256_i32gather_epi32(wide_table, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(A + i + 16))), 4);
+		__m256i d = _mm256_i32gather_epi32(wide_table, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(A + i + 24))), 4);
+
+		__m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d)); // values are 0-255, packing is exact
+		_mm256_storeu_si256((__m256i*)(O + i), _mm256_permutevar8x32_epi32(packed, order));
+	}
+
+	for (; i < n; i++)
+		O[i] = table[A[i]];
+}
+
+// AVX-512 VBMI looks up 64 pixels in a 128 entry table with one permute, so the 256 entry table takes two and a blend
+HOST_TARGET("avx512f,avx512bw,avx512vbmi") inline void HostApplyLutAvx512(const unsigned char* A, unsigned char* O, size_t n, const unsigned char* table) {
+	__m512i table_0 = _mm512_loadu_si512((const void*)table);
+	__m512i table_1 = _mm512_loadu_si512((const void*)(table + 64));
+	__m512i table_2 = _mm512_loadu_si512((const void*)(table + 128));
+	__m512i table_3 = _mm512_loadu_si512((const void*)(table + 192));
+	size_t i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		__m512i pixels = _mm512_loadu_si512((const void*)(A + i));
+		__m512i low = _mm512_permutex2var_epi8(table_0, pixels, table_1); // entries 0-127, bit 7 of the index is ignored
+		__m512i high = _mm512_permutex2var_epi8(table_2, pixels, table_3); // entries 128-255
+		__mmask64 upper = _mm512_movepi8_mask(pixels); // pixels with bit 7 set take the upper half
+		_mm512_storeu_si512((void*)(O + i), _mm512_mask_blend_epi8(upper, low, high));
+	}
+
+	if (i < n) { // the rest with a masked load and store rather than a scalar loop
+		__mmask64 tail = (~0ULL) >> (64 - (n - i));
+		__m512i pixels = _mm512_maskz_loadu_epi8(tail, (const void*)(A + i));
+		__m512i low = _mm512_permutex2var_epi8(table_0, pixels, table_1);
+		__m512i high = _mm512_permutex2var_epi8(table_2, pixels, table_3);
+		_mm512_mask_storeu_epi8((void*)(O + i), tail, _mm512_mask_blend_epi8(_mm512_movepi8_mask(pixels), low, high));
+	}
+}
+
+#endif
+
+typedef void (*HostHistogramFunction)(const unsigned char* A, size_t n, int* counts);
+typedef void (*HostApplyLutFunction)(const unsigned char* A, unsigned char* O, size_t n, const unsigned char* table);
+
+// Histogram and look up table functions for an ISA, which must not be wider than DetectHostIsa reports
+inline void HostSimdFunctions(HostIsa isa, HostHistogramFunction& histogram, HostApplyLutFunction& apply_lut) {
+	histogram = HostHistogramScalar;
+	apply_lut = HostApplyLutScalar;
+#ifdef HOST_SIMD_X86
+	if (isa == HOST_AVX512) {
+		histogram = HostHistogramAvx2; // wider loads measured no faster, the increments are the limit
+		apply_lut = HostApplyLutAvx512;
+	}
+	else if (isa == HOST_AVX2) {
+		histogram = HostHistogramAvx2;
+		apply_lut = HostApplyLutAvx2;
+	}
+#endif
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+
+// Launch configuration found by HistEqEngine::autotune for one device and image size class. 0 keeps the engine's default.
+struct HistEqTuning {
+	int hist_local_size = 0; // work-group size of hist_local and hist_vector
+	int pixels_per_item = 0; // strip length of hist_vector
+	int back_proj_local_size = 0; // work-group size of back_proj, 0 also when the driver's choice was fastest
+};
+
+// Size class of an image - launch configurations are tuned and looked up per class rather than per exact size
+inline std::string TuningSizeClass(size_t pixels) {
+	if (pixels < (1 << 19)) return "small"; // up to about 720x720
+	if (pixels < (1 << 22)) return "medium"; // up to about 2048x2048
+	return "large";
+}
+
+// Tuning file format: one line per configuration, "<key>\t<size class>\t<hist_local_size> <pixels_per_item> <back_proj_local_size>",
+// where the key names the device, driver and kernel variant the sizes were measured with.
+
+// Every configuration stored under key, by size class. A missing file simply has none.
+inline std::map<std::string, HistEqTuning> LoadTunings(const std::string& file_name, const std::string& key) {
+	std::map<std::string, HistEqTuning> tunings;
+	std::ifstream file(file_name);
+	std::string line;
+
+	while (std::getline(file, line)) {
+		std::stringstream fields(line);
+		std::string line_key, size_class;
+		HistEqTuning tuning;
+		if (std::getline(fields, line_key, '\t') && (line_key == key) && std::getline(fields, size_class, '\t')
+			&& (fields >> tuning.hist_local_size >> tuning.pixels_per_item >> tuning.back_proj_local_size))
+			tunings[size_class] = tuning;
+	}
+
+	return tunings;
+}
+
+// Store the configuration for key and size class, replacing any earlier one and keeping every other line of the file
+inline bool SaveTuning(const std::string& file_name, const std::string& key, const std::string& size_class, const HistEqTuning& tuning) {
+	std::vector<std::string> lines;
+	std::ifstream old_file(file_name);
+	std::string line, prefix = key + "\t" + size_class + "\t";
+
+	while (std::getline(old_file, line)) {
+		if (!line.empty() && (line.compare(0, prefix.size(), prefix) != 0))
+			lines.push_back(line);
+	}
+	old_file.close();
+
+	std::stringstream entry;
+	entry << prefix << tuning.hist_local_size << " " << tuning.pixels_per_item << " " << tuning.back_proj_local_size;
+	lines.push_back(entry.str());
+
+	std::ofstream file(file_name, std::ios::trunc);
+	for (const std::string& l : lines)
+		file << l << '\n';
+
+	if (!file) {
+		std::cerr << "Cannot write tuning file " << file_name << std::endl;
+		return false;
+	}
+	return true;
+}
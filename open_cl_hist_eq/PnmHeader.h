@@ -0,0 +1,49 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+
+#include "Utils.h"
+
+// Header of a PNM image with 8-bit samples - P2 or P5 greyscale, P3 or P6 colour
+struct PnmHeader {
+	int width = 0, height = 0, channels = 0, max_value = 0;
+	bool binary = false; // P5 or P6, whose raster is raw bytes straight after the header, samples of a pixel interleaved
+	unsigned long long raster_offset = 0; // first byte of a binary raster
+
+	unsigned long long raster_size() const { return (unsigned long long)width * height * channels; }
+};
+
+// Read the header of a PNM file, so an image can be decoded straight into zero-copy memory or its raster mapped.
+// Returns false for anything else, including samples wider than 8 bits.
+bool ReadPnmHeader(const string& file_name, PnmHeader& header) {
+	ifstream file(file_name, ios::binary);
+	string magic;
+	int values[3]; // width, height, maximum value
+
+	if (!(file >> magic))
+		return false;
+	if ((magic == "P2") || (magic == "P5")) header.channels = 1;
+	else if ((magic == "P3") || (magic == "P6")) header.channels = 3;
+	else return false;
+	header.binary = (magic == "P5") || (magic == "P6");
+
+	for (int i = 0; i < 3; i++) {
+		file >> std::ws;
+		while (file.peek() == '#') { // comment lines may sit between any two header values
+			string comment;
+			getline(file, comment);
+			file >> std::ws;
+		}
+		if (!(file >> values[i]))
+			return false;
+	}
+	if (file.get() == EOF) // exactly one whitespace character ends the header
+		return false;
+
+	header.width = values[0];
+	header.height = values[1];
+	header.max_value = values[2];
+	header.raster_offset = (unsigned long long)file.tellg();
+	return (header.width > 0) && (header.height > 0) && (header.max_value > 0) && (header.max_value < 256);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "Utils.h"
+
+// 64-bit FNV-1a hash, stable between runs and compilers so it can be used in file names
+uint64_t HashString(const string& text) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+string HashToHex(uint64_t hash) {
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+	return hex;
+}
+
+// Creates the directory if it does not exist yet, an existing directory is not an error
+void MakeDirectory(const string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+// Everything that makes a binary valid for reuse - the binary is only loaded if all of it matches
+string ProgramCacheKey(const cl::Device& device, const string& source, const string& build_options) {
+	stringstream key;
+	key << device.getInfo<CL_DEVICE_NAME>() << "|" << device.getInfo<CL_DRIVER_VERSION>() << "|" << HashToHex(HashString(source)) << "|" << build_options;
+	return key.str();
+}
+
+// Build the program from source, printing the build log on failure
+void BuildProgram(cl::Program& program, const cl::Device& device, const string& build_options) {
+	try {
+		program.build({ device }, build_options.c_str());
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		throw err;
+	}
+}
+
+// Build source for one device, reusing the binary from an earlier run when the device, driver, source and build options
+// are unchanged. Each binary is stored in cache_dir as <key hash>.bin, with the full key on the first line so a hash
+// collision or a stale file is rebuilt rather than loaded. An empty cache_dir disables the cache.
+cl::Program BuildProgramCached(const cl::Context& context, const cl::Device& device, const string& source, const string& build_options, const string& cache_dir, bool* from_cache = NULL) {
+	if (from_cache != NULL)
+		*from_cache = false;
+
+	if (cache_dir.empty()) {
+		cl::Program program(context, source);
+		BuildProgram(program, device, build_options);
+		return program;
+	}
+
+	string key = ProgramCacheKey(device, source, build_options);
+	string file_name = cache_dir + "/" + HashToHex(HashString(key)) + ".bin";
+
+	ifstream cached(file_name, ios::binary);
+	string cached_key;
+	if (cached && getline(cached, cached_key) && (cached_key == key)) {
+		cl::Program::Binaries binaries(1);
+		binaries[0].assign(istreambuf_iterator<char>(cached), istreambuf_iterator<char>());
+
+		// a driver may still reject a binary it wrote itself, in that case fall through to a source build
+		try {
+			cl::Program program(context, { device }, binaries);
+			program.build({ device }, build_options.c_str()); // binaries still need building, but skip the compiler
+			if (from_cache != NULL)
+				*from_cache = true;
+			return program;
+		}
+		catch (const cl::Error&) {
+			std::cout << "Cached program binary " << file_name << " was rejected, rebuilding from source" << std::endl;
+		}
+	}
+	cached.close();
+
+	cl::Program program(context, source);
+	BuildProgram(program, device, build_options);
+
+	cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	if (binaries.empty() || binaries[0].empty())
+		return program; // nothing to cache on this runtime
+
+	// write to a temporary file and rename, so another process never loads a half written binary
+	MakeDirectory(cache_dir);
+	string temp_name = file_name + ".tmp";
+	{
+		ofstream file(temp_name, ios::binary | ios::trunc);
+		file << key << '\n';
+		file.write((const char*)binaries[0].data(), binaries[0].size());
+		if (!file)
+			return program; // cache is best effort, the built program is still good
+	}
+	std::remove(file_name.c_str()); // rename does not replace an existing file on Windows
+	if (std::rename(temp_name.c_str(), file_name.c_str()) != 0)
+		std::remove(temp_name.c_str());
+
+	return program;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+// Helpers shared by the machine-readable reports (benchmark results, profiles, traces)
+
+// text as a quoted JSON string
+inline std::string JsonString(const std::string& text) {
+	std::string json = "\"";
+	for (char c : text) {
+		if ((c == '"') || (c == '\\')) {
+			json += '\\';
+			json += c;
+		}
+		else if ((unsigned char)c < 0x20) { // control characters, e.g. from device names
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+			json += escaped;
+		}
+		else {
+			json += c;
+		}
+	}
+	return json + "\"";
+}
+
+// Nearest-rank percentile p (0-100) of the samples, 0 when there are none
+inline double Percentile(std::vector<double> samples, double p) {
+	if (samples.empty())
+		return 0;
+
+	std::sort(samples.begin(), samples.end());
+	size_t rank = (size_t)std::ceil(p / 100 * samples.size());
+	return samples[(rank > 0) ? rank - 1 : 0];
+}
@@ -0,0 +1,40 @@
+# Writes EmbeddedKernels.h, a string table holding every kernels\*.cl file, so the executable does not need the kernel
+# files at run time. Run as a pre-build event - the header is regenerated on every build and is not kept in git.
+# MSVC limits a single string literal to 16KB, so each file is split into raw string pieces that the compiler joins.
+
+$project_dir = Split-Path -Parent $MyInvocation.MyCommand.Path
+$output_file = Join-Path $project_dir "EmbeddedKernels.h"
+$delimiter = "__CL__"
+$lines_per_piece = 100
+
+$header = New-Object System.Text.StringBuilder
+[void]$header.AppendLine("// Generated by embed_kernels.ps1 from kernels\*.cl - do not edit")
+[void]$header.AppendLine("#pragma once")
+[void]$header.AppendLine("")
+[void]$header.AppendLine("struct EmbeddedKernel {")
+[void]$header.AppendLine("`tconst char* name; // file name within kernels\")
+[void]$header.AppendLine("`tconst char* source;")
+[void]$header.AppendLine("};")
+[void]$header.AppendLine("")
+[void]$header.AppendLine("static const EmbeddedKernel embedded_kernels[] = {")
+
+foreach ($file in Get-ChildItem (Join-Path $project_dir "kernels") -Filter *.cl | Sort-Object Name) {
+	$lines = Get-Content $file.FullName
+	[void]$header.AppendLine("`t{ `"$($file.Name)`",")
+
+	for ($i = 0; $i -lt $lines.Count; $i += $lines_per_piece) {
+		$last = [Math]::Min($i + $lines_per_piece, $lines.Count) - 1
+		$piece = ($lines[$i..$last] -join "`n") + "`n"
+		[void]$header.AppendLine("`t`tR`"$delimiter($piece)$delimiter`"")
+	}
+
+	[void]$header.AppendLine("`t},")
+}
+
+[void]$header.AppendLine("};")
+
+# only touch the header when it changes, so an unchanged kernel does not trigger a rebuild
+$text = $header.ToString()
+if (!(Test-Path $output_file) -or ((Get-Content $output_file -Raw) -ne $text)) {
+	[System.IO.File]::WriteAllText($output_file, $text)
+}
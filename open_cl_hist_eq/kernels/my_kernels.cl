@@ -1,23 +1,122 @@
-kernel void hist(global const uchar* A, global int* H, int bin_size, int bit_depth) { 
-	int id = get_global_id(0);
+// The host may specialise the program with build options: -D BIN_SIZE and -D MAX_INTENSITY fix the histogram shape so loops
+// over the bins have constant bounds, and when every pixel value has its own bin the bin table lookup is dropped altogether.
+// -D HIST_GROUP_SIZE fixes the work-group size of the local histogram kernels, which then size their sub-histogram statically,
+// and -D LUT_GROUP_SIZE does the same for hist_lut. Without them every kernel falls back to its runtime arguments.
+#if defined(BIN_SIZE) && defined(MAX_INTENSITY) && (BIN_SIZE == MAX_INTENSITY)
+#define BIN_OF(M, pix) (pix) // one bin per pixel value
+#else
+#define BIN_OF(M, pix) M[pix]
+#endif
+
+#ifdef BIN_SIZE
+#define BINS BIN_SIZE
+#else
+#define BINS bin_size
+#endif
+
+#ifdef HIST_GROUP_SIZE
+#define HIST_ATTRIBUTES __attribute__((reqd_work_group_size(HIST_GROUP_SIZE, 1, 1)))
+#define HIST_LOCAL_SIZE HIST_GROUP_SIZE
+#else
+#define HIST_ATTRIBUTES
+#define HIST_LOCAL_SIZE get_local_size(0)
+#endif
 
-	int pix_value = A[id]; // take pixel value
+#ifdef LUT_GROUP_SIZE
+#define LUT_ATTRIBUTES __attribute__((reqd_work_group_size(LUT_GROUP_SIZE, 1, 1)))
+#else
+#define LUT_ATTRIBUTES
+#endif
+
+// M is the pixel value to bin index table built on the host, shared by all histogram kernels and back_proj
+kernel void hist(global const uchar* A, global int* H, global const int* M) { 
+	int id = get_global_id(0);
 
-	float norm = (float)pix_value / (float)bit_depth; // normalise value to between 0 and 1
-	int bin_index = round(norm * bin_size); // scale value to fit within bounds of H
+	int bin_index = BIN_OF(M, A[id]); // look up the bin for this pixel value
 
 	atomic_inc(&H[bin_index]); //serial operation, not very efficient!
 }
 
-// Scan Add algorithm - a double-buffered version of the Hillis-Steele inclusive scan
-kernel void hist_cumulative(__global const int* A, global int* B, local int* scratch_1, local int* scratch_2) {
+// Privatised histogram - each work-group accumulates into its own local sub-histogram and merges it into global memory once
+// With HIST_GROUP_SIZE defined the sub-histogram is a static local array and the LH argument is unused.
+kernel HIST_ATTRIBUTES void hist_local(global const uchar* A, global int* H, local int* LH_arg, global const int* M, int bin_size, int pixel_count) {
 	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = HIST_LOCAL_SIZE;
+#ifdef HIST_GROUP_SIZE
+	local int LH[BINS];
+#else
+	local int* LH = LH_arg;
+#endif
+
+	// clear the local histogram, work-items take every Nth bin so any bin_size is covered
+	for (int i = lid; i < BINS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE); // local histogram must be cleared before anyone adds to it
+
+	if (id < pixel_count) // global size is padded up to a multiple of the work-group size
+		atomic_inc(&LH[BIN_OF(M, A[id])]); // contention is now limited to the work-items of one group
+
+	barrier(CLK_LOCAL_MEM_FENCE); // wait for the whole group to finish counting
+
+	// merge into the global histogram, one atomic per non-empty bin per group
+	for (int i = lid; i < BINS; i += N) {
+		if (LH[i] != 0)
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
+// Vectorised privatised histogram - each work-item reads strips of pixels_per_item pixels 16 at a time and strides over the image,
+// so the launch is sized to the device rather than to the image. pixels_per_item should be a multiple of 16.
+kernel HIST_ATTRIBUTES void hist_vector(global const uchar* A, global int* H, local int* LH_arg, global const int* M, int bin_size, int pixel_count, int pixels_per_item) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = HIST_LOCAL_SIZE;
+#ifdef HIST_GROUP_SIZE
+	local int LH[BINS];
+#else
+	local int* LH = LH_arg;
+#endif
+	size_t stride = get_global_size(0) * pixels_per_item; // pixels covered by the whole grid in one pass, size_t so base cannot wrap near INT_MAX
+	uchar pix[16]; // unpacked vector
+
+	for (int i = lid; i < BINS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE); // local histogram must be cleared before anyone adds to it
+
+	for (size_t base = (size_t)id * pixels_per_item; base < (size_t)pixel_count; base += stride) {
+		size_t end = min(base + pixels_per_item, (size_t)pixel_count); // last strip may be cut short by the end of the image
+		size_t i = base;
+
+		for (; i + 16 <= end; i += 16) {
+			vstore16(vload16(0, A + i), 0, pix); // one 16 byte load per 16 pixels
+
+			for (int j = 0; j < 16; j++)
+				atomic_inc(&LH[BIN_OF(M, pix[j])]);
+		}
+
+		for (; i < end; i++) // remaining pixels that do not fill a vector
+			atomic_inc(&LH[BIN_OF(M, A[i])]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE); // wait for the whole group to finish counting
+
+	for (int i = lid; i < BINS; i += N) {
+		if (LH[i] != 0)
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
+// Scan Add algorithm - a double-buffered version of the Hillis-Steele inclusive scan across one work-group
+// Takes one value per work-item and returns that work-item's inclusive prefix sum
+int scan_add_work_group(int value, local int* scratch_1, local int* scratch_2) {
 	int lid = get_local_id(0);
 	int N = get_local_size(0);
 	local int *scratch_3; // used for buffer swap
 
-	// cache all N values from global memory to local memory
-	scratch_1[lid] = A[id];
+	scratch_1[lid] = value;
 
 	barrier(CLK_LOCAL_MEM_FENCE); // wait for all local threads to finish copying from global to local memory
 
@@ -35,13 +134,87 @@ kernel void hist_cumulative(__global const int* A, global int* B, local int* scr
 		scratch_1 = scratch_3;
 	}
 
+	return scratch_1[lid];
+}
+
+// Each work-group scans its own block of n values, larger inputs are completed with block_sum and scan_add_adjust
+kernel void hist_cumulative(__global const int* A, global int* B, local int* scratch_1, local int* scratch_2, int n) {
+	int id = get_global_id(0);
+
+	// cache all N values from global memory to local memory, padding past the end of the input with zeros
+	int value = scan_add_work_group((id < n) ? A[id] : 0, scratch_1, scratch_2);
+
 	// copy the cache to output array
-	B[id] = scratch_1[lid];
+	if (id < n)
+		B[id] = value;
+}
+
+// Single-pass scan with decoupled look-back - each work-group scans one tile, publishes its total, then finds the total of all
+// earlier tiles from the tiles before it, so any n is scanned in one launch.
+// status holds a tile counter followed by one flag per tile (0: nothing yet, 1: tile total ready, 2: inclusive prefix ready)
+// and must be zeroed before the launch. values holds the tile totals followed by the inclusive prefixes.
+kernel void hist_cumulative_lb(global const int* A, global int* B, global int* status, global int* values, local int* scratch_1, local int* scratch_2, int n) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int tile_count = get_num_groups(0);
+	global int* flags = status + 1;
+	global int* aggregates = values;
+	global int* prefixes = values + tile_count;
+	local int tile; // tile this work-group scans
+	local int tile_prefix; // total of every tile before it
+
+	// tiles are handed out in the order work-groups start rather than by group id, so a tile only ever waits on tiles
+	// whose work-groups are already running and the look-back cannot deadlock
+	if (lid == 0)
+		tile = atomic_inc(&status[0]);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int id = tile * N + lid;
+	int value = scan_add_work_group((id < n) ? A[id] : 0, scratch_1, scratch_2);
+
+	if (lid == N - 1) { // the last work-item holds the tile total
+		int prefix = 0;
+
+		if (tile > 0) {
+			atomic_xchg(&aggregates[tile], value); // atomic so other work-groups see it, a fence alone only orders this work-item's stores
+			mem_fence(CLK_GLOBAL_MEM_FENCE); // total before the flag that says it is there
+			atomic_xchg(&flags[tile], 1);
+
+			// walk back until a tile with a full prefix is found, adding up the totals of the tiles in between
+			for (int t = tile - 1; t >= 0; ) {
+				int flag = atomic_or(&flags[t], 0); // atomic read bypasses any stale cached copy
+				if (flag == 0)
+					continue; // tile t has not finished its local scan yet
+
+				if (flag == 2) {
+					prefix += atomic_or(&prefixes[t], 0);
+					break;
+				}
+
+				prefix += atomic_or(&aggregates[t], 0);
+				t--;
+			}
+		}
+
+		atomic_xchg(&prefixes[tile], prefix + value);
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		atomic_xchg(&flags[tile], 2); // later tiles can stop their look-back here
+
+		tile_prefix = prefix;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < n)
+		B[id] = value + tile_prefix;
 }
 
-kernel void normalise_array(global const int* H, global float* N, float B) {
+// H is the cumulative histogram of n bins, so the maximum B is its last value - read here rather than by the host
+kernel void normalise_array(global const int* H, global float* N, int n) {
 	int id = get_global_id(0);
 	float hist_value = (float)H[id];
+	float B = (float)H[n - 1];
 
 	N[id] = hist_value / B; // divide by B
 }
@@ -53,55 +226,98 @@ kernel void lut(global const float* N, global int* L) {
 	L[id] = norm * 255; // multiply by (desired range - 1 = 255)
 }
 
-kernel void back_proj(global const uchar* I, global uchar* O, global int* L, int bin_size, int bit_depth) {
+// Fused cumulative histogram, normalisation and look up table for a histogram of n bins that fits in one work-group.
+// The total is the last value of the scan, so it never has to be read back by the host.
+kernel LUT_ATTRIBUTES void hist_lut(global const int* H, global int* L, local int* scratch_1, local int* scratch_2, int n) {
 	int id = get_global_id(0);
-	int pix = I[id]; // get old pixel value
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	local float total; // number of pixels counted
 
-	// normalise and scale to create a lut index
-	float norm = (float)pix / (float)bit_depth; // normalise value to between 0 and 1
-	int lut_index = round(norm * bin_size); // spread out value to fit within bounds of H
+	int value = scan_add_work_group((id < n) ? H[id] : 0, scratch_1, scratch_2); // cumulative histogram
 
-	O[id] = L[lut_index]; // use as index for look up table
-}
+	if (lid == N - 1)
+		total = value; // padding past n is zero, so the last work-item always holds the total
 
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-/////// Blelloch attempt
+	if (id < n)
+		L[id] = ((float)value / total) * 255; // same maths as normalise_array followed by lut
+}
 
-// Blelloch basic exclusive scan
-kernel void scan_bl(global int* A) {
+kernel void back_proj(global const uchar* I, global uchar* O, global int* L, global const int* M) {
 	int id = get_global_id(0);
-	int N = get_global_size(0);
-	int t;
 
-	// up-sweep (first stage)
-	for (int stride = 1; stride < N; stride *= 2) {
-		if (((id + 1) % (stride*2)) == 0)
-			A[id] += A[id - stride];
+	O[id] = L[BIN_OF(M, I[id])]; // same pixel to bin mapping as the histogram, then through the look up table
+}
+
+
+/////// Blelloch
+
+#define LOG_NUM_BANKS 5 // 32 local memory banks on current GPUs
+#define CONFLICT_FREE_OFFSET(i) ((i) >> LOG_NUM_BANKS) // one padding slot every 32 elements keeps strided accesses in different banks
+
+// Work-efficient Blelloch scan of one block per work-group - up-sweep then down-sweep over a single padded scratch array.
+// Each work-item handles two values, so a block is 2 * local size values and the local size must be a power of two.
+// scratch needs 2 * local size + CONFLICT_FREE_OFFSET(2 * local size) ints. Output is inclusive, like hist_cumulative.
+kernel void hist_cumulative_bl(global const int* A, global int* B, local int* scratch, int n) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0) * 2; // values per block
+	int block_start = get_group_id(0) * N;
+	int ai = lid; // first value handled by this work-item
+	int bi = lid + N / 2; // second value, half a block further on
+	int a_value = (block_start + ai < n) ? A[block_start + ai] : 0; // pad past the end of the input with zeros
+	int b_value = (block_start + bi < n) ? A[block_start + bi] : 0;
+	int offset = 1;
+
+	scratch[ai + CONFLICT_FREE_OFFSET(ai)] = a_value;
+	scratch[bi + CONFLICT_FREE_OFFSET(bi)] = b_value;
+
+	// up-sweep (first stage) - build partial sums in place
+	for (int d = N / 2; d > 0; d /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE); // sync the step with other instances
 
-		barrier(CLK_GLOBAL_MEM_FENCE); // sync the step with other instances
+		if (lid < d) {
+			int i = offset * (2 * lid + 1) - 1;
+			int j = offset * (2 * lid + 2) - 1;
+			scratch[j + CONFLICT_FREE_OFFSET(j)] += scratch[i + CONFLICT_FREE_OFFSET(i)];
+		}
+		offset *= 2;
 	}
 
 	//down-sweep (second stage)
-	if (id == 0)
-		A[N-1] = 0; // exclusive scan
+	if (lid == 0)
+		scratch[N - 1 + CONFLICT_FREE_OFFSET(N - 1)] = 0; // exclusive scan
 
-	barrier(CLK_GLOBAL_MEM_FENCE); //sync the step
+	for (int d = 1; d < N; d *= 2) {
+		offset /= 2;
+		barrier(CLK_LOCAL_MEM_FENCE); // sync the step with other instances
 
-	for (int stride = N/2; stride > 0; stride /= 2) {
-		if (((id + 1) % (stride*2)) == 0) {
-			t = A[id];
-			A[id] += A[id - stride]; // reduce 
-			A[id - stride] = t;		 // move
-		}
+		if (lid < d) {
+			int i = offset * (2 * lid + 1) - 1;
+			int j = offset * (2 * lid + 2) - 1;
+			i += CONFLICT_FREE_OFFSET(i);
+			j += CONFLICT_FREE_OFFSET(j);
 
-		barrier(CLK_GLOBAL_MEM_FENCE); // sync the step with other instances
+			int t = scratch[i];
+			scratch[i] = scratch[j]; // move
+			scratch[j] += t;		 // reduce
+		}
 	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// adding each original value back turns the exclusive scan into an inclusive one
+	if (block_start + ai < n)
+		B[block_start + ai] = scratch[ai + CONFLICT_FREE_OFFSET(ai)] + a_value;
+	if (block_start + bi < n)
+		B[block_start + bi] = scratch[bi + CONFLICT_FREE_OFFSET(bi)] + b_value;
 }
 
-// Calculates the block sums
-kernel void block_sum(global const int* A, global int* B, int local_size) {
+// Calculates the block sums from the block-wise inclusive scan of n values
+kernel void block_sum(global const int* A, global int* B, int block_size, int n) {
 	int id = get_global_id(0);
-	B[id] = A[(id + 1) * local_size - 1]; // Nth block * final element ID = ID of final element of current block
+	B[id] = A[min((id + 1) * block_size, n) - 1]; // Nth block * final element ID = ID of final element of current block (the last block may be partial)
 }
 
 // Simple exclusive serial scan based on atomic operations - sufficient for small number of elements
@@ -113,8 +329,17 @@ kernel void scan_add_atomic(global int* A, global int* B) {
 }
 
 // Adjust the values stored in partial scans by adding the block sums to corresponding blocks
-kernel void scan_add_adjust(global int* A, global const int* B) {
+// B is the inclusive scan of the block sums, so each block needs the total of every block before it
+kernel void scan_add_adjust(global int* A, global const int* B, int block_size, int n) {
 	int id = get_global_id(0);
-	int gid = get_group_id(0);
-	A[id] += B[gid];
-}
\ No newline at end of file
+	int block = id / block_size; // blocks are not tied to work-groups, a Blelloch block is twice its group size
+	if ((block > 0) && (id < n))
+		A[id] += B[block - 1];
+}
+
+// Bandwidth probe - each work-item copies 16 bytes, about the simplest kernel that can reach peak memory bandwidth, so
+// the time of the other kernels can be compared against it
+kernel void copy_probe(global const uint4* A, global uint4* B) {
+	int id = get_global_id(0);
+	B[id] = A[id];
+}
@@ -23,17 +23,33 @@ Optimisation strategies:
 	- The scan add algorithm is used in the hist_cumulative() kernel.
 	- The hist_cumulative() kernel uses local memory.
 	- Buffers are re-used where possible to reduce memory transfer times.
-	- Blelloch steps are attempted but not implemented as part of main program.
-
-	(word count: 112)
+	- Multi-level, Blelloch and single-pass look-back scans, and a kernel fusing the scan, normalisation and look up table (see -scan, -lut).
+	- Privatised and vectorised histogram kernels, specialised at build time with -D constants (see -hist, -generic).
+	- One engine keeps the context, cached program binaries, kernels and buffers, and chains every stage on the device with events.
+	- Batches overlap uploads, kernels and downloads on three queues, with zero-copy buffers on shared-memory devices (see -batch).
+	- A threaded AVX2/AVX-512 host backend, and a per-image choice between the backends (see -backend).
+	- Images too large for one buffer are streamed in strips, files too large for memory are mapped a tile at a time (see -strip, -out_of_core).
+	- Profiling, Chrome traces, roofline reports, autotuning and a synthetic benchmark (see -profile, -trace, -roofline, -autotune, -bench).
+	- Every option is described by -h.
+
+	(word count: 228)
 */
 
 #include <iostream>
 #include <vector>
 #include <numeric>
+#include <chrono>
 
 #include "Utils.h"
 #include "CImg.h"
+#include "HistEqEngine.h"
+#include "HistEqBatch.h"
+#include "HostHistEq.h"
+#include "HistEqAuto.h"
+#include "HistEqBench.h"
+#include "HistEqProfile.h"
+#include "ChromeTrace.h"
+#include "HistEqOutOfCore.h"
 
 using namespace cimg_library;
 
@@ -44,22 +60,130 @@ void print_help() {
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -backend : opencl, host for native threads without OpenCL, or auto to pick per image by size, also as --backend=host (default: opencl)" << std::endl;
+	std::cerr << "  -threads : worker threads for the host backend (default: one per hardware thread)" << std::endl;
+	std::cerr << "  -host_isa : SIMD for the host backend, auto, avx512, avx2 or scalar (default: auto)" << std::endl;
+	std::cerr << "  -recalibrate : measure the -backend auto cost model again rather than loading it from the cache" << std::endl;
+	std::cerr << "  -host_bench : time the host SIMD loops against scalar on the -f image (e.g. test_large.ppm) and exit" << std::endl;
+	std::cerr << "  -batch : equalise every image in this directory, or listed one per line in this file, without display" << std::endl;
+	std::cerr << "  -depth : images in flight during -batch, 1 for no pipelining (default: 3)" << std::endl;
+	std::cerr << "  -o : output directory for -batch (default: output), or output file for a single image (no display)" << std::endl;
+	std::cerr << "  -out_of_core : equalise the -f PGM or PPM into the -o file through memory-mapped tiles on the host, for images larger than memory" << std::endl;
+	std::cerr << "  -working_set : MB of the input and output files -out_of_core maps at once (default: 256)" << std::endl;
+	std::cerr << "  -zero_copy : image buffers over host memory, on, off or auto (default: auto, on when the device shares host memory)" << std::endl;
+	std::cerr << "  -strip : stream images of more pixels than this through strips of at most this many (default: the device's largest buffer)" << std::endl;
+	std::cerr << "  -hist : histogram kernel, global, local or vector (default: local)" << std::endl;
+	std::cerr << "  -scan : cumulative histogram scan, hs (Hillis-Steele), bl (Blelloch) or lb (single-pass look-back), bl and lb imply -lut separate (default: hs)" << std::endl;
+	std::cerr << "  -scan_bench : check the multi-level scan against the host, compare the scan kernels at 256, 1024, 4096 and 65536 bins and exit" << std::endl;
+	std::cerr << "  -lut : fused (Hillis-Steele cumulative, normalise and lut in one kernel) or separate (default: fused, separate with -scan bl or lb)" << std::endl;
+	std::cerr << "  -debug : read back and print the histogram, cumulative histogram and look up table" << std::endl;
+	std::cerr << "  -ppi : pixels per work-item for the vector histogram, multiple of 16 (default: 64)" << std::endl;
+	std::cerr << "  -kernels : load the kernels from this .cl file instead of the embedded copy, for kernel development" << std::endl;
+	std::cerr << "  -generic : read bin_size and max_intensity as kernel arguments instead of building specialised kernels" << std::endl;
+	std::cerr << "  -profile : also write the profile of the single image run to this JSON file" << std::endl;
+	std::cerr << "  -roofline : measure the device's peak copy and transfer bandwidth and show each command's share of it" << std::endl;
+	std::cerr << "  -trace : write a chrome://tracing or Perfetto timeline of the OpenCL queues and host work to this JSON file" << std::endl;
+	std::cerr << "  -bench : benchmark both backends on synthetic images and exit, writing bench.json and bench.csv" << std::endl;
+	std::cerr << "  -bench_sizes : comma separated image sizes in MPix (default: 0.1,1,10,100)" << std::endl;
+	std::cerr << "  -bench_dists : comma separated intensity distributions, uniform, dark or single (default: all three)" << std::endl;
+	std::cerr << "  -warmup : untimed runs before each measurement (default: 3)" << std::endl;
+	std::cerr << "  -repeats : timed runs per measurement (default: 50)" << std::endl;
+	std::cerr << "  -bench_out : output file name without extension (default: bench)" << std::endl;
+	std::cerr << "  -autotune : sweep the kernel work-group sizes and pixels per item on the -f image, save the fastest and exit" << std::endl;
+	std::cerr << "  -tuning : file of tuned launch sizes, loaded at startup and written by -autotune (default: tuning.txt)" << std::endl;
+	std::cerr << "  -no_tuning : ignore tuned launch sizes" << std::endl;
+	std::cerr << "  -cache : directory for cached program binaries (default: kernel_cache)" << std::endl;
+	std::cerr << "  -no_cache : always build the kernels from source" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
+// Host wall-clock time since start in ns
+unsigned long long ElapsedNs(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Show the raw and enhanced images until either window is closed, or save the enhanced image when an output file is given
+void display_or_save(const CImg<unsigned char>& image_input, const CImg<unsigned char>& output_image, const string& output_path) {
+	if (!output_path.empty()) {
+		output_image.save(output_path.c_str()); // headless single image
+		return;
+	}
+
+	CImgDisplay disp_input(image_input, "Raw image"); // display raw image with title
+	CImgDisplay disp_output(output_image,"Enahnced image"); // display enhanced image
+
+	while (!disp_input.is_closed() && !disp_output.is_closed()
+		&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+		disp_input.wait(1);
+		disp_output.wait(1);
+	}
+}
+
 int main(int argc, char **argv) {
+	typedef std::chrono::steady_clock clock;
 
 	int platform_id = 0; // specify default OpenCL platform ID
 	int device_id = 0; // specify default OpenCL device ID
 
 	// Handle command line options such as device selection, verbosity, etc.
 	string image_filename = "test.pgm";
+	HistEqOptions options; // kernel variants, see HistEqEngine.h for defaults
+	bool scan_bench = false; // benchmark the scan kernels instead of processing an image
+	bool host_bench = false; // benchmark the host SIMD loops instead of processing an image
+	bool autotune = false; // tune launch sizes instead of processing an image
+	bool bench = false; // synthetic image benchmark instead of processing an image
+	string bench_sizes = "0.1,1,10,100", bench_dists = "uniform,dark,single", bench_out = "bench";
+	int warmup = 3, repeats = 50;
+	bool recalibrate = false; // ignore the cached -backend auto cost model
+	string batch_input = ""; // directory or list file for headless batch processing
+	int batch_depth = 3; // images in flight during a batch
+	string output_path = ""; // batch output directory, or single output image (no display when set)
+	string profile_path = ""; // JSON profile of the single image run
+	string trace_path = ""; // Chrome trace of the device and host timelines
+	bool roofline = false; // measure peak bandwidth and report each command against it
+	bool out_of_core = false; // equalise a mapped PNM file a tile at a time instead of loading it
+	size_t working_set = 256; // MB mapped at once by out_of_core
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); } // custom platform id
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); } // custom device id
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; } // list platforms and devices
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; } // custom image
+		else if ((strcmp(argv[i], "-backend") == 0) && (i < (argc - 1))) { options.backend = argv[++i]; } // opencl, host or auto
+		else if (strncmp(argv[i], "--backend=", 10) == 0) { options.backend = argv[i] + 10; }
+		else if ((strcmp(argv[i], "-threads") == 0) && (i < (argc - 1))) { options.host_threads = atoi(argv[++i]); } // host worker threads
+		else if ((strcmp(argv[i], "-host_isa") == 0) && (i < (argc - 1))) { options.host_isa = argv[++i]; } // host SIMD
+		else if (strcmp(argv[i], "-recalibrate") == 0) { recalibrate = true; } // new auto backend cost model
+		else if (strcmp(argv[i], "-host_bench") == 0) { host_bench = true; } // host SIMD benchmark
+		else if ((strcmp(argv[i], "-batch") == 0) && (i < (argc - 1))) { batch_input = argv[++i]; } // headless batch
+		else if ((strcmp(argv[i], "-depth") == 0) && (i < (argc - 1))) { batch_depth = atoi(argv[++i]); } // pipeline depth
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_path = argv[++i]; } // output location
+		else if ((strcmp(argv[i], "-profile") == 0) && (i < (argc - 1))) { profile_path = argv[++i]; } // machine-readable profile
+		else if (strcmp(argv[i], "-roofline") == 0) { roofline = true; } // bandwidth report
+		else if ((strcmp(argv[i], "-trace") == 0) && (i < (argc - 1))) { trace_path = argv[++i]; } // timeline for chrome://tracing
+		else if (strcmp(argv[i], "-out_of_core") == 0) { out_of_core = true; } // memory-mapped tiles
+		else if ((strcmp(argv[i], "-working_set") == 0) && (i < (argc - 1))) { working_set = strtoull(argv[++i], NULL, 10); } // out-of-core memory bound
+		else if ((strcmp(argv[i], "-zero_copy") == 0) && (i < (argc - 1))) { options.zero_copy = argv[++i]; } // zero-copy image buffers
+		else if ((strcmp(argv[i], "-strip") == 0) && (i < (argc - 1))) { options.strip_size = strtoull(argv[++i], NULL, 10); } // strip streaming
+		else if ((strcmp(argv[i], "-hist") == 0) && (i < (argc - 1))) { options.hist_mode = argv[++i]; } // histogram kernel variant
+		else if ((strcmp(argv[i], "-scan") == 0) && (i < (argc - 1))) { options.scan_mode = argv[++i]; } // scan kernel variant
+		else if (strcmp(argv[i], "-scan_bench") == 0) { scan_bench = true; } // scan benchmark
+		else if ((strcmp(argv[i], "-lut") == 0) && (i < (argc - 1))) { options.fuse_lut = (strcmp(argv[++i], "separate") != 0); } // fused or separate lut kernels
+		else if (strcmp(argv[i], "-debug") == 0) { options.debug = true; } // intermediate readbacks
+		else if ((strcmp(argv[i], "-ppi") == 0) && (i < (argc - 1))) { options.pixels_per_item = atoi(argv[++i]); } // pixels per work-item
+		else if ((strcmp(argv[i], "-kernels") == 0) && (i < (argc - 1))) { options.kernel_file = argv[++i]; } // external kernel source
+		else if (strcmp(argv[i], "-generic") == 0) { options.specialise = false; } // unspecialised kernels
+		else if ((strcmp(argv[i], "-cache") == 0) && (i < (argc - 1))) { options.cache_dir = argv[++i]; } // program binary cache
+		else if (strcmp(argv[i], "-no_cache") == 0) { options.cache_dir = ""; } // build from source every run
+		else if (strcmp(argv[i], "-bench") == 0) { bench = true; } // synthetic benchmark
+		else if ((strcmp(argv[i], "-bench_sizes") == 0) && (i < (argc - 1))) { bench_sizes = argv[++i]; }
+		else if ((strcmp(argv[i], "-bench_dists") == 0) && (i < (argc - 1))) { bench_dists = argv[++i]; }
+		else if ((strcmp(argv[i], "-warmup") == 0) && (i < (argc - 1))) { warmup = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-repeats") == 0) && (i < (argc - 1))) { repeats = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-bench_out") == 0) && (i < (argc - 1))) { bench_out = argv[++i]; }
+		else if (strcmp(argv[i], "-autotune") == 0) { autotune = true; } // launch size sweep
+		else if ((strcmp(argv[i], "-tuning") == 0) && (i < (argc - 1))) { options.tuning_file = argv[++i]; } // tuned launch sizes
+		else if (strcmp(argv[i], "-no_tuning") == 0) { options.tuning_file = ""; } // default launch sizes
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; } // display help page
 	}
 
@@ -67,203 +191,174 @@ int main(int argc, char **argv) {
 
 	// detect any potential exceptions
 	try {
-		bool bit_depth_16 = false; // modifiable
-
-		int max_intensity = 256;
-		CImg<unsigned char> image_input(image_filename.c_str()); // init image
-
-		if (bit_depth_16 == true) {
-			CImg<unsigned short> image_input(image_filename.c_str()); // init image
+		if (host_bench) {
+			CImg<unsigned char> image_input(image_filename.c_str());
+			BenchmarkHostSimd(image_input.data(), image_input.size());
+			return 0;
 		}
 
-		CImgDisplay disp_input(image_input, "Raw image"); // display raw image with title
-
-		// Host operations
-		cl::Context context = GetContext(platform_id, device_id); // select computing devices to be used with kernels
-		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl; // display the selected hardware	
-		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE); // create a queue to which we will push commands for the device
-
-		cl::Program::Sources sources; // load and build device code from file
-		AddSources(sources, "kernels/my_kernels.cl"); // file
-		cl::Program program(context, sources);
-
-		//build and debug the kernel code
-		try { 
-			program.build();
+		if (bench) { // the host always, the device unless -backend host
+			std::vector<double> sizes;
+			std::vector<string> distributions;
+			stringstream size_list(bench_sizes), distribution_list(bench_dists);
+			for (string item; getline(size_list, item, ',');)
+				sizes.push_back(atof(item.c_str()));
+			for (string item; getline(distribution_list, item, ',');)
+				distributions.push_back(item);
+
+			HostHistEq host(options, options.host_threads);
+			std::unique_ptr<HistEqEngine> engine;
+			if (options.backend != "host")
+				engine.reset(new HistEqEngine(platform_id, device_id, options));
+
+			RunBenchmark(engine.get(), host, sizes, distributions, warmup, repeats, bench_out);
+			return 0;
 		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
-
-		/////////// Calculate histogram ////////////////////////////////////////////////////////////////////////////////////////////
-
-		int bin_size = 256; // Variable bin size
-		std::vector<int> histogram(bin_size); // make bin size of histogram equal to amount of intensities in input image
-		size_t histogram_size = histogram.size() * sizeof(int); // get byte length of histogram space
-
-		cl::Buffer buffer_image_input(context, CL_MEM_READ_ONLY, image_input.size()); // prepare input buffer for the kernel
-		cl::Buffer buffer_histogram(context, CL_MEM_READ_WRITE, histogram_size); // prepare output buffer for the kernel
-
-		cl::Event event_hist_write; // create event to measure performance
-		queue.enqueueWriteBuffer(buffer_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0], NULL, &event_hist_write); // write input image to input buffer
-
-		cl::Kernel kernel = cl::Kernel(program, "hist"); // create hist kernel 
-		kernel.setArg(0, buffer_image_input); // set appropriate arguements (arrays start at 0)
-		kernel.setArg(1, buffer_histogram);
-		kernel.setArg(2, bin_size);
-		kernel.setArg(3, max_intensity);
-
-		cl::Event event_hist_kernel; // new event for histogram calculation kernel
-		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &event_hist_kernel); // being task (with event)
-		
-		cl::Event event_hist_read; // timing event for data retrieval
-		queue.enqueueReadBuffer(buffer_histogram, CL_TRUE, 0, histogram_size, &histogram[0], NULL, &event_hist_read); // copy results from device to host (with timing event)
-
-		std::cout << "Raw histogram = " << histogram << std::endl << std::endl; // display calculated histogram for debug purposes
-
-
-		/////////// Create cumulative histogram  ///////////////////////////////////////////////////////////////////////////////////
-
-		std::vector<int> cumulative_histogram(bin_size); // needs identical bin size
-		size_t cumulative_histogram_size = cumulative_histogram.size() * sizeof(int); // calc total size in bytes
 
-		cl::Buffer buffer_cumulative_histogram(context, CL_MEM_READ_WRITE, cumulative_histogram_size); // create output buffer for cumulative histogram
-
-		kernel = cl::Kernel(program, "hist_cumulative"); // create handle for hist_cumulative kernel
-		kernel.setArg(0, buffer_histogram); // re-use previously filled buffer
-		kernel.setArg(1, buffer_cumulative_histogram); // set output buffer
-		kernel.setArg(2, cl::Local(histogram_size)); // size for scratch 1
-		kernel.setArg(3, cl::Local(histogram_size)); // size for scratch 2
-
-		cl::Event event_cumulative_kernel; // event for cumulative kernel
-		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(cumulative_histogram.size()), cl::NullRange, NULL, &event_cumulative_kernel); // begin cumulative histogram task
-
-		cl::Event event_cumulative_read; // event for reading cumulative histogram
-		queue.enqueueReadBuffer(buffer_cumulative_histogram, CL_TRUE, 0, cumulative_histogram_size, &cumulative_histogram[0], NULL, &event_cumulative_read); // read cumulative histogram
-
-		std::cout << "Cumulative histogram = " << cumulative_histogram << std::endl << std::endl; // display for debug purposes
-
-
-		/////////// Normalise histogram  ///////////////////////////////////////////////////////////////////////////////////////////
-
-		float max = cumulative_histogram.back(); // Get the max value, which will be the final value in the array.
-
-		std::vector<float> norm_histogram(bin_size); // bin size
-		size_t norm_histogram_size = norm_histogram.size() * sizeof(float); // size of normalised histogram vector
-
-		cl::Buffer buffer_norm_histogram(context, CL_MEM_READ_WRITE, norm_histogram_size); // new buffer for normalised histogram result
-
-		kernel = cl::Kernel(program, "normalise_array"); // set kernel target to normalise_array
-		kernel.setArg(0, buffer_cumulative_histogram); // set args
-		kernel.setArg(1, buffer_norm_histogram);
-		kernel.setArg(2, max);
-
-		cl::Event event_norm_kernel; // new event for normalisation kernel
-		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(norm_histogram.size()), cl::NullRange, NULL, &event_norm_kernel); // begin normalisation task
-		
-		cl::Event event_norm_read; // event for reading normalisation buffer
-		queue.enqueueReadBuffer(buffer_norm_histogram, CL_TRUE, 0, norm_histogram_size, &norm_histogram[0], NULL, &event_norm_read); // read normalisation buffer
-
-		std::cout << "Normalised histogram = " << norm_histogram << std::endl << std::endl; // display for debug purposes
-
-
-		/////////// Create look up table /////////////////////////////////////////////////////////////////////////////////////////////////
+		if (out_of_core) { // host only, the tiles are read from and written to the mapped files in place
+			if (output_path.empty()) {
+				std::cerr << "-out_of_core needs an output file (-o)" << std::endl;
+				return 0;
+			}
+
+			HostHistEq host(options, options.host_threads);
+			OutOfCoreTimes times;
+			if (EqualizeOutOfCore(host, image_filename, output_path, working_set << 20, &times)) {
+				std::cout << image_filename << " -> " << output_path << ": " << times.tile_count << " tiles of " << times.tile_size << " bytes, "
+					<< host.get_thread_count() << " threads, " << HostIsaName(host.get_isa()) << std::endl;
+				std::cout << "Histogram time (ns): " << times.hist << std::endl;
+				std::cout << "Look up table time (ns): " << times.lut << std::endl;
+				std::cout << "Image enhancement time (ns): " << times.back_proj << std::endl;
+				std::cout << "Total program execution time (ns): " << times.hist + times.lut + times.back_proj << std::endl;
+			}
+			return 0;
+		}
 
-		std::vector<int> lut(bin_size); // look up table
-		size_t lut_size = lut.size() * sizeof(int); // get lut size in bytes
+		if (options.backend == "host") { // native threads, no OpenCL platform needed
+			HostHistEq host(options, options.host_threads);
+			std::cout << "Running on the host, " << host.get_thread_count() << " threads, " << HostIsaName(host.get_isa()) << std::endl;
+
+			if (!batch_input.empty()) {
+				std::vector<string> inputs = BatchInputs(batch_input);
+				if (inputs.empty())
+					std::cerr << "No images found in " << batch_input << std::endl;
+				RunSerialBatch(host, inputs, output_path.empty() ? "output" : output_path);
+				return 0;
+			}
+
+			CImg<unsigned char> image_input(image_filename.c_str()); // init image
+			CImg<unsigned char> output_image = host.equalize(image_input); // same pipeline as the kernels, same output
+
+			display_or_save(image_input, output_image, output_path);
+
+			const HostHistEqTimes& times = host.get_times();
+			std::cout << "Histogram time (ns): " << times.hist << std::endl;
+			std::cout << "Look up table time (ns): " << times.lut << std::endl;
+			std::cout << "Image enhancement time (ns): " << times.back_proj << std::endl;
+			std::cout << "Total program execution time (ns): " << times.hist + times.lut + times.back_proj << std::endl;
+			return 0;
+		}
 
-		cl::Buffer buffer_lut(context, CL_MEM_READ_WRITE, lut_size); // create buffer for lut output
+		if (options.backend == "auto") { // host or device per image, whichever the cost model predicts is faster
+			HistEqAuto backends(platform_id, device_id, options, recalibrate);
 
-		kernel = cl::Kernel(program, "lut"); // set target to lut kernel
-		kernel.setArg(0, buffer_norm_histogram); // set args
-		kernel.setArg(1, buffer_lut);
+			if (!batch_input.empty()) {
+				std::vector<string> inputs = BatchInputs(batch_input);
+				if (inputs.empty())
+					std::cerr << "No images found in " << batch_input << std::endl;
+				RunSerialBatch(backends, inputs, output_path.empty() ? "output" : output_path);
+				return 0;
+			}
 
-		cl::Event event_lut_kernel; // event for lut kernel
-		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(lut_size), cl::NullRange, NULL, &event_lut_kernel); // begin lut task
+			CImg<unsigned char> image_input(image_filename.c_str()); // init image
+			CImg<unsigned char> output_image = backends.equalize(image_input); // logs the backend used
 
-		cl::Event event_lut_read; // event for lut buffer read
-		queue.enqueueReadBuffer(buffer_lut, CL_TRUE, 0, lut_size, &lut.data()[0], NULL, &event_lut_read); // read the lut buffer
+			display_or_save(image_input, output_image, output_path);
+			return 0;
+		}
 
-		std::cout << "Look up table = " << lut << std::endl << std::endl; // display for debug purposes
+		// Host operations - context, program, kernels and buffers live in the engine and are reused for every image
+		clock::time_point setup_start = clock::now();
+		HistEqEngine engine(platform_id, device_id, options);
+		unsigned long long setup_time = ElapsedNs(setup_start); // context, queues and program build or cache load
 
+		std::unique_ptr<ChromeTrace> trace;
+		if (!trace_path.empty()) {
+			trace.reset(new ChromeTrace(engine.get_context(), engine.get_device(), setup_start));
+			trace->add_host("setup", setup_start, setup_time);
+		}
+		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl; // display the selected hardware	
 
-		/////////// Create enhanced image from LUT ///////////////////////////////////////////////////////////////////////////////////////
-		
-		std::vector<unsigned char> image_output(image_input.size()); // create space for image output
-		size_t image_output_size = image_output.size(); // calc size
+		if (autotune) {
+			CImg<unsigned char> image_input(image_filename.c_str());
+			engine.autotune(image_input);
+			return 0;
+		}
 
-		cl::Buffer buffer_output(context, CL_MEM_READ_WRITE, image_output_size); // new buffer for enhanced image output
+		if (scan_bench) {
+			engine.benchmark_scans();
+			return 0;
+		}
 
-		kernel = cl::Kernel(program, "back_proj"); // target back_proj kernel
-		kernel.setArg(0, buffer_image_input); // set args
-		kernel.setArg(1, buffer_output);
-		kernel.setArg(2, buffer_lut);
-		kernel.setArg(3, bin_size);
-		kernel.setArg(4, max_intensity);
+		if (!batch_input.empty()) { // headless, no display or key wait
+			std::cout << "Zero-copy image buffers: " << engine.get_options().zero_copy << std::endl;
+			std::vector<string> inputs = BatchInputs(batch_input);
+			if (inputs.empty())
+				std::cerr << "No images found in " << batch_input << std::endl;
+			RunBatch(engine, inputs, output_path.empty() ? "output" : output_path, batch_depth, trace.get());
+			if (trace && trace->write(trace_path))
+				std::cout << "Trace written to " << trace_path << std::endl;
+			return 0;
+		}
 
-		cl::Event event_enhance_kernel; // event for enhancement kernel
-		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &event_enhance_kernel); // begin enhancement kernel
+		bool bit_depth_16 = false; // modifiable
 
-		cl::Event event_enhance_read; // event for reading results
-		queue.enqueueReadBuffer(buffer_output, CL_TRUE, 0, image_output_size, &image_output.data()[0], NULL, &event_enhance_read); // read from buffer
+		clock::time_point load_start = clock::now();
+		CImg<unsigned char> image_input(image_filename.c_str()); // init image
+		unsigned long long load_time = ElapsedNs(load_start);
 
+		if (bit_depth_16 == true) {
+			CImg<unsigned short> image_input(image_filename.c_str()); // init image
+		}
 
-		CImg<unsigned char> output_image(image_output.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum()); // new image from enhanced data
-		CImgDisplay disp_output(output_image,"Enahnced image"); // display enhanced image
+		clock::time_point equalize_start = clock::now();
+		CImg<unsigned char> output_image = engine.equalize(image_input); // histogram, look up table and back projection on the device
+		unsigned long long equalize_time = ElapsedNs(equalize_start);
 
-		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-			disp_input.wait(1);
-			disp_output.wait(1);
-		}
+		clock::time_point save_start = clock::now();
+		display_or_save(image_input, output_image, output_path);
+		unsigned long long save_time = ElapsedNs(save_start); // only meaningful when saving, the display waits for a key
 
 		/////////// Performance monitoring ///////////////////////////////////////////////////////////////////////////////////////////////
 
-		std::vector<unsigned long long> performance = {
-			event_hist_write.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_hist_write.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_hist_kernel.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_hist_kernel.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_hist_read.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_hist_read.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_cumulative_kernel.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_cumulative_kernel.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_cumulative_read.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_cumulative_read.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_norm_kernel.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_norm_kernel.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_norm_read.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_norm_read.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_lut_kernel.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_lut_kernel.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_lut_read.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_lut_read.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_enhance_kernel.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_enhance_kernel.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
-			event_enhance_read.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event_enhance_read.getProfilingInfo<CL_PROFILING_COMMAND_START>()
-		};
-
-		std::cout << "Histogram calculation:" << std::endl; // Performance monitoring for creating the histogram
-		std::cout << "- buffer write time (ns): " << performance[0] << std::endl;
-		std::cout << "- \"hist\" kernel execution time (ns): " << performance[1] << std::endl;
-		std::cout << "- buffer read time (ns): " << performance[2] << std::endl;
-		std::cout << std::endl; // line break
-		std::cout << "Cumulative histogram calculation:" << std::endl; // Performance monitoring for creating the cumulative histogram
-		std::cout << "- \"hist_cumulative\" kernel execution time (ns): " << performance[3] << std::endl;
-		std::cout << "- buffer read time (ns): " << performance[4] << std::endl;
-		std::cout << std::endl; // line break
-		std::cout << "Normalised histogram calculation:" << std::endl; // Performance monitoring for creating the normalised histogram
-		std::cout << "- \"divide_array\" kernel execution time (ns): " << performance[5] << std::endl;
-		std::cout << "- buffer read time (ns): " << performance[6] << std::endl;
-		std::cout << std::endl; // line break
-		std::cout << "Look up table calculation:" << std::endl; // Performance monitoring for creating the look up table
-		std::cout << "- \"lut\" kernel execution time (ns): " << performance[7] << std::endl;
-		std::cout << "- buffer read time (ns): " << performance[8] << std::endl;
-		std::cout << std::endl; // line break
-		std::cout << "Image enhancement:" << std::endl; // Performance monitoring for applying the look up table to the original
-		std::cout << "- \"back_prop\" kernel execution time (ns) :" << performance[9] << std::endl;
-		std::cout << "- buffer read time (ns): " << performance[10] << std::endl;
-		std::cout << std::endl;
-		std::cout << "Memory transfer time (ns): " << performance[0] + performance[2] + performance[4] + performance[6] + performance[8] + performance[10] << std::endl;
-		std::cout << "Kernel execution time (ns): " << performance[1] + performance[3] + performance[5] + performance[7] + performance[9] << std::endl;
-		std::cout << "Total program execution time (ns): " << std::accumulate(performance.begin(), performance.end(), 0) << std::endl;
+		HistEqProfile profile;
+		profile.add_commands(engine.get_events(), engine.get_options(), image_input.size()); // variants actually used on this device
+		profile.add_host("setup", setup_time);
+		profile.add_host("load", load_time);
+		profile.add_host("equalize", equalize_time);
+		if (!output_path.empty())
+			profile.add_host("save", save_time);
+		if (roofline)
+			profile.set_peaks(engine.measure_bandwidth());
+
+		profile.print(std::cout);
+		if (!profile_path.empty() && profile.write_json(profile_path))
+			std::cout << "Profile written to " << profile_path << std::endl;
+
+		if (trace) {
+			trace->add_device(profile.get_commands(), image_filename);
+			trace->add_host("load", load_start, load_time);
+			trace->add_host("equalize", equalize_start, equalize_time);
+			if (!output_path.empty())
+				trace->add_host("save", save_start, save_time);
+			if (trace->write(trace_path))
+				std::cout << "Trace written to " << trace_path << std::endl;
+		}
 
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		std::cerr << "(-backend host runs without OpenCL)" << std::endl;
 	}
 	catch (CImgException& err) {
 		std::cerr << "ERROR: " << err.what() << std::endl;